@@ -54,15 +54,21 @@
 #define UTIL_WEIGHT .60
 
 /* 
- * Alignment requirement in bytes (either 4 or 8) 
+ * Alignment requirement in bytes (4, 8 or 16) 
  */
-#define ALIGNMENT 8  
+#define ALIGNMENT 16  
 
 /* 
  * Maximum heap size in bytes 
  */
 #define MAX_HEAP (20*(1<<20))  /* 20 MB */
 
+/*
+ * Address space reserved by the mmap-backed memory system in
+ * memlib_mmap.c, which commits it only as the heap grows
+ */
+#define MMAP_MAX_HEAP (1<<30)  /* 1 GB */
+
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
  *****************************************************************************/
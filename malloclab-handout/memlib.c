@@ -3,6 +3,8 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* for mremap */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -10,14 +12,69 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <sys/resource.h>
 
 #include "memlib.h"
 #include "config.h"
 
+/* A region mapped outside the heap for one large block */
+typedef struct mapping {
+    char *lo;
+    size_t len;
+    struct mapping *next;
+} mapping_t;
+
 /* private variables */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
+static mapping_t *mem_maps;  /* live mappings for large blocks */
+static size_t mem_mapped_bytes; /* bytes in them */
+static size_t mem_peak;      /* most heap plus mapped bytes since the last reset */
+static long mem_minflt;      /* page faults at the last reset */
+static long mem_majflt;
+
+/* count_faults - the page faults the process has taken so far */
+static void count_faults(long *minflt, long *majflt)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    *minflt = ru.ru_minflt;
+    *majflt = ru.ru_majflt;
+}
+
+/* update_peak - note the current heap plus mapped bytes if they are a new peak */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped_bytes;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/* find_mapping - the link to the mapping at lo; it links to NULL if there is none */
+static mapping_t **find_mapping(void *lo)
+{
+    mapping_t **mp;
+
+    for (mp = &mem_maps; *mp != NULL && (*mp)->lo != (char *)lo; mp = &(*mp)->next)
+	;
+    return mp;
+}
+
+/* unmap_all - give back the mappings still live at a reset */
+static void unmap_all(void)
+{
+    mapping_t *m;
+
+    while ((m = mem_maps) != NULL) {
+	mem_maps = m->next;
+	munmap(m->lo, m->len);
+	free(m);
+    }
+    mem_mapped_bytes = 0;
+}
 
 /* 
  * mem_init - initialize the memory system model
@@ -32,6 +89,8 @@ void mem_init(void)
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_peak = 0;
+    count_faults(&mem_minflt, &mem_majflt);
 }
 
 /* 
@@ -47,27 +106,117 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
+    unmap_all();
     mem_brk = mem_start_brk;
+    mem_peak = 0;
+    count_faults(&mem_minflt, &mem_majflt);
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap by -incr bytes.
  */
 void *mem_sbrk(int incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if ((incr < 0 && -incr > mem_brk - mem_start_brk) ||
+	(incr > 0 && incr > mem_max_addr - mem_brk)) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
     mem_brk += incr;
+    update_peak();
     return (void *)old_brk;
 }
 
+/*
+ * mem_discard - tell the memory system that the heap bytes in
+ *    [ptr, ptr + len) hold nothing worth keeping, so their pages may
+ *    be given back. This model holds the heap in one malloc'd array,
+ *    which it can't give back in part, so it does nothing.
+ */
+void mem_discard(void *ptr, size_t len)
+{
+}
+
+/*
+ * mem_map - map len bytes, a multiple of the base page size, outside
+ *    the heap for one large block. Returns their address, or (void *)-1
+ *    on error.
+ */
+void *mem_map(size_t len)
+{
+    char *p;
+    mapping_t *m;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return (void *)-1;
+    if ((m = malloc(sizeof(mapping_t))) == NULL) {
+	munmap(p, len);
+	return (void *)-1;
+    }
+    m->lo = p;
+    m->len = len;
+    m->next = mem_maps;
+    mem_maps = m;
+    mem_mapped_bytes += len;
+    update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_unmap - give a mapping from mem_map back to the kernel
+ */
+void mem_unmap(void *ptr, size_t len)
+{
+    mapping_t **mp = find_mapping(ptr), *m = *mp;
+
+    if (m != NULL) {
+	*mp = m->next;
+	mem_mapped_bytes -= m->len;
+	free(m);
+    }
+    munmap(ptr, len);
+}
+
+/*
+ * mem_remap - resize a mapping from mem_map to new_len bytes, moving
+ *    it if need be. Returns its new address, or (void *)-1 on error.
+ */
+void *mem_remap(void *ptr, size_t old_len, size_t new_len)
+{
+    mapping_t *m = *find_mapping(ptr);
+    char *p;
+
+    p = mremap(ptr, old_len, new_len, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+	return (void *)-1;
+    if (m != NULL) {
+	m->lo = p;
+	mem_mapped_bytes += new_len - m->len;
+	m->len = new_len;
+    }
+    update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_mapped - is [lo, hi] inside a single mapping from mem_map
+ */
+int mem_mapped(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    for (m = mem_maps; m != NULL; m = m->next)
+	if ((char *)lo >= m->lo && (char *)hi < m->lo + m->len)
+	    return 1;
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +241,15 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest heap size plus bytes
+ *    mapped with mem_map, since the heap was last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -99,3 +257,16 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_faults - returns the minor and major page faults the process
+ *    has taken since the heap was last reset. Pages of the malloc'd
+ *    array stay mapped across resets, so after the first trace only
+ *    a heap that grows past its earlier peak takes any.
+ */
+void mem_faults(long *minflt, long *majflt)
+{
+    count_faults(minflt, majflt);
+    *minflt -= mem_minflt;
+    *majflt -= mem_majflt;
+}
@@ -3,9 +3,16 @@
 void mem_init(void);               
 void mem_deinit(void);
 void *mem_sbrk(int incr);
+void mem_discard(void *ptr, size_t len);
+void *mem_map(size_t len);
+void mem_unmap(void *ptr, size_t len);
+void *mem_remap(void *ptr, size_t old_len, size_t new_len);
+int mem_mapped(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peak_heapsize(void);
 size_t mem_pagesize(void);
+void mem_faults(long *minflt, long *majflt);
 
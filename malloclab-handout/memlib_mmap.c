@@ -0,0 +1,377 @@
+/*
+ * memlib_mmap.c - a memory system model backed by real virtual memory.
+ *
+ * Link it in place of memlib.o to run the allocator against the page
+ * behavior of the machine rather than a slice of a malloc'd array.
+ * mem_init reserves MMAP_MAX_HEAP bytes of address space with
+ * PROT_NONE, and mem_sbrk commits it, HUGE_PAGE bytes at a time, as
+ * the heap grows. Shrinking the heap, resetting it and mem_discard
+ * give pages back to the kernel, so every trace starts on untouched
+ * memory and mem_faults counts the page faults it really takes. Blocks
+ * the allocator maps with mem_map get base pages of their own.
+ *
+ * The environment variable MEMLIB_HUGEPAGES picks the pages behind
+ * the heap:
+ *
+ *   unset or "none"  base pages;
+ *   "thp"            transparent huge pages, asked for with madvise;
+ *   "explicit"       hugetlb pages (MAP_HUGETLB), which have to be set
+ *                    aside in /proc/sys/vm/nr_hugepages beforehand.
+ *                    The heap falls back to base pages once none are
+ *                    left.
+ */
+#define _GNU_SOURCE  /* for mremap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include "memlib.h"
+#include "config.h"
+
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+#define HUGE_PAGE (2*(1<<20))  /* size of an x86 huge page */
+
+/* The kind of pages behind the heap */
+enum { PAGES_BASE, PAGES_THP, PAGES_EXPLICIT };
+
+/* A region mapped outside the heap for one large block */
+typedef struct mapping {
+    char *lo;
+    size_t len;
+    struct mapping *next;
+} mapping_t;
+
+/* private variables */
+static char *mem_start_brk;  /* points to first byte of heap */
+static char *mem_brk;        /* points to last byte of heap */
+static char *mem_max_addr;   /* largest legal heap address */
+static mapping_t *mem_maps;  /* live mappings for large blocks */
+static size_t mem_mapped_bytes; /* bytes in them */
+static size_t mem_peak;      /* most heap plus mapped bytes since the last reset */
+static char *mem_commit;     /* end of the readable and writable part */
+static int mem_pages;        /* PAGES_xxx */
+static long mem_minflt;      /* page faults at the last reset */
+static long mem_majflt;
+
+/* count_faults - the page faults the process has taken so far */
+static void count_faults(long *minflt, long *majflt)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    *minflt = ru.ru_minflt;
+    *majflt = ru.ru_majflt;
+}
+
+/* update_peak - note the current heap plus mapped bytes if they are a new peak */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped_bytes;
+
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
+/* find_mapping - the link to the mapping at lo; it links to NULL if there is none */
+static mapping_t **find_mapping(void *lo)
+{
+    mapping_t **mp;
+
+    for (mp = &mem_maps; *mp != NULL && (*mp)->lo != (char *)lo; mp = &(*mp)->next)
+	;
+    return mp;
+}
+
+/* unmap_all - give back the mappings still live at a reset */
+static void unmap_all(void)
+{
+    mapping_t *m;
+
+    while ((m = mem_maps) != NULL) {
+	mem_maps = m->next;
+	munmap(m->lo, m->len);
+	free(m);
+    }
+    mem_mapped_bytes = 0;
+}
+
+/*
+ * commit - make the reservation readable and writable up to end,
+ *    rounded up to a huge page. Returns -1 on error.
+ */
+static int commit(char *end)
+{
+    char *new_commit;
+    size_t len;
+
+    new_commit = (char *)(((uintptr_t)end + HUGE_PAGE - 1) & ~((uintptr_t)HUGE_PAGE - 1));
+    len = new_commit - mem_commit;
+    if (mem_pages == PAGES_EXPLICIT) {
+	if (mmap(mem_commit, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+		 -1, 0) != MAP_FAILED) {
+	    mem_commit = new_commit;
+	    return 0;
+	}
+	fprintf(stderr, "mem_sbrk: out of huge pages, using base pages\n");
+	mem_pages = PAGES_BASE;
+
+	/* A failed MAP_FIXED may already have unmapped the range */
+	if (mmap(mem_commit, len, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+		 -1, 0) == MAP_FAILED)
+	    return -1;
+    }
+    else if (mprotect(mem_commit, len, PROT_READ | PROT_WRITE) < 0)
+	return -1;
+    mem_commit = new_commit;
+    return 0;
+}
+
+/*
+ * release - give the pages wholly inside [lo, hi) back to the kernel.
+ *    They stay committed and read as zeros when next touched. hugetlb
+ *    pages are only given back whole.
+ */
+static void release(char *lo, char *hi)
+{
+    uintptr_t page = (mem_pages == PAGES_EXPLICIT) ? HUGE_PAGE : getpagesize();
+    char *start = (char *)(((uintptr_t)lo + page - 1) & ~(page - 1));
+    char *end = (char *)((uintptr_t)hi & ~(page - 1));
+
+    if (end > start)
+	madvise(start, end - start, MADV_DONTNEED);
+}
+
+/*
+ * mem_init - reserve the address space of the heap
+ */
+void mem_init(void)
+{
+    char *p, *env = getenv("MEMLIB_HUGEPAGES");
+    size_t len = MMAP_MAX_HEAP + HUGE_PAGE;
+
+    mem_pages = PAGES_BASE;
+    if (env != NULL && strcmp(env, "thp") == 0)
+	mem_pages = PAGES_THP;
+    else if (env != NULL && strcmp(env, "explicit") == 0)
+	mem_pages = PAGES_EXPLICIT;
+    else if (env != NULL && *env != '\0' && strcmp(env, "none") != 0) {
+	fprintf(stderr, "mem_init_vm: unknown MEMLIB_HUGEPAGES %s\n", env);
+	exit(1);
+    }
+
+    /* Reserve, aligned to a huge page so that huge pages can back it */
+    p = mmap(NULL, len, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
+	exit(1);
+    }
+    mem_start_brk = (char *)(((uintptr_t)p + HUGE_PAGE - 1) & ~((uintptr_t)HUGE_PAGE - 1));
+    if (mem_start_brk > p)
+	munmap(p, mem_start_brk - p);
+    munmap(mem_start_brk + MMAP_MAX_HEAP, p + HUGE_PAGE - mem_start_brk);
+
+    if (mem_pages == PAGES_THP &&
+	madvise(mem_start_brk, MMAP_MAX_HEAP, MADV_HUGEPAGE) < 0) {
+	fprintf(stderr, "mem_init_vm: no transparent huge pages, using base pages\n");
+	mem_pages = PAGES_BASE;
+    }
+
+    mem_max_addr = mem_start_brk + MMAP_MAX_HEAP;  /* max legal heap address */
+    mem_brk = mem_start_brk;                       /* heap is empty initially */
+    mem_peak = 0;
+    mem_commit = mem_start_brk;
+    count_faults(&mem_minflt, &mem_majflt);
+}
+
+/*
+ * mem_deinit - unmap the heap
+ */
+void mem_deinit(void)
+{
+    munmap(mem_start_brk, MMAP_MAX_HEAP);
+}
+
+/*
+ * mem_reset_brk - reset the brk pointer to make an empty heap, and
+ *    give all of its pages back
+ */
+void mem_reset_brk()
+{
+    release(mem_start_brk, mem_commit);
+    unmap_all();
+    mem_brk = mem_start_brk;
+    mem_peak = 0;
+    count_faults(&mem_minflt, &mem_majflt);
+}
+
+/*
+ * mem_sbrk - extends the heap by incr bytes, committing address space
+ *    as needed, and returns the start address of the new area. A
+ *    negative incr shrinks the heap by -incr bytes and gives the pages
+ *    above the new end back.
+ */
+void *mem_sbrk(int incr)
+{
+    char *old_brk = mem_brk;
+
+    if ((incr < 0 && -incr > mem_brk - mem_start_brk) ||
+	(incr > 0 && incr > mem_max_addr - mem_brk) ||
+	(mem_brk + incr > mem_commit && commit(mem_brk + incr) < 0)) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    mem_brk += incr;
+    if (incr < 0)
+	release(mem_brk, old_brk);
+    update_peak();
+    return (void *)old_brk;
+}
+
+/*
+ * mem_discard - give the pages wholly inside [ptr, ptr + len) back to
+ *    the kernel; the heap holds nothing worth keeping there
+ */
+void mem_discard(void *ptr, size_t len)
+{
+    release((char *)ptr, (char *)ptr + len);
+}
+
+/*
+ * mem_map - map len bytes, a multiple of the base page size, outside
+ *    the heap for one large block. Returns their address, or (void *)-1
+ *    on error.
+ */
+void *mem_map(size_t len)
+{
+    char *p;
+    mapping_t *m;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+	return (void *)-1;
+    if ((m = malloc(sizeof(mapping_t))) == NULL) {
+	munmap(p, len);
+	return (void *)-1;
+    }
+    m->lo = p;
+    m->len = len;
+    m->next = mem_maps;
+    mem_maps = m;
+    mem_mapped_bytes += len;
+    update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_unmap - give a mapping from mem_map back to the kernel
+ */
+void mem_unmap(void *ptr, size_t len)
+{
+    mapping_t **mp = find_mapping(ptr), *m = *mp;
+
+    if (m != NULL) {
+	*mp = m->next;
+	mem_mapped_bytes -= m->len;
+	free(m);
+    }
+    munmap(ptr, len);
+}
+
+/*
+ * mem_remap - resize a mapping from mem_map to new_len bytes, moving
+ *    it if need be. Returns its new address, or (void *)-1 on error.
+ */
+void *mem_remap(void *ptr, size_t old_len, size_t new_len)
+{
+    mapping_t *m = *find_mapping(ptr);
+    char *p;
+
+    p = mremap(ptr, old_len, new_len, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+	return (void *)-1;
+    if (m != NULL) {
+	m->lo = p;
+	mem_mapped_bytes += new_len - m->len;
+	m->len = new_len;
+    }
+    update_peak();
+    return (void *)p;
+}
+
+/*
+ * mem_mapped - is [lo, hi] inside a single mapping from mem_map
+ */
+int mem_mapped(void *lo, void *hi)
+{
+    mapping_t *m;
+
+    for (m = mem_maps; m != NULL; m = m->next)
+	if ((char *)lo >= m->lo && (char *)hi < m->lo + m->len)
+	    return 1;
+    return 0;
+}
+
+/*
+ * mem_heap_lo - return address of the first heap byte
+ */
+void *mem_heap_lo()
+{
+    return (void *)mem_start_brk;
+}
+
+/*
+ * mem_heap_hi - return address of last heap byte
+ */
+void *mem_heap_hi()
+{
+    return (void *)(mem_brk - 1);
+}
+
+/*
+ * mem_heapsize() - returns the heap size in bytes
+ */
+size_t mem_heapsize()
+{
+    return (size_t)(mem_brk - mem_start_brk);
+}
+
+/*
+ * mem_peak_heapsize() - returns the largest heap size plus bytes
+ *    mapped with mem_map, since the heap was last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak;
+}
+
+/*
+ * mem_pagesize() - returns the size of the pages behind the heap
+ */
+size_t mem_pagesize()
+{
+    return (mem_pages == PAGES_BASE) ? (size_t)getpagesize() : HUGE_PAGE;
+}
+
+/*
+ * mem_faults - returns the minor and major page faults the process
+ *    has taken since the heap was last reset
+ */
+void mem_faults(long *minflt, long *majflt)
+{
+    count_faults(minflt, majflt);
+    *minflt -= mem_minflt;
+    *majflt -= mem_majflt;
+}
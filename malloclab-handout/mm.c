@@ -1,5 +1,61 @@
 /*
- * Implement explicit free lists
+ * Implement segregated explicit free lists with a two-level index
+ *
+ * Free blocks are kept in doubly linked lists by size class, arranged
+ * as in TLSF: each power-of-two range from 16 bytes up (the first
+ * level) is cut into SL_COUNT equal slices (the second level), and
+ * each slice has its own list. The list heads, one bitmap of
+ * non-empty slices per power of two and a bitmap of the powers of two
+ * that have any free block all live in the heap prologue, so the
+ * allocator keeps no state outside the heap and serves whichever heap
+ * memlib hands it (mm_mt.c gives each thread its own).
+ *
+ * A request first takes the best fit in its own slice, whose blocks
+ * may be a little smaller than it. Failing that, every block in any
+ * higher slice fits, and two find-first-set operations on the bitmaps
+ * name the closest non-empty one in constant time. Since a slice spans
+ * at most 1/SL_COUNT of its sizes, that block is within 12.5% of the
+ * best fit.
+ *
+ * Only free blocks carry a footer. Every header keeps, next to the
+ * block's own allocated bit, a bit telling whether the block before it
+ * is allocated; coalescing looks for the previous block's footer only
+ * when that bit says it is free. An allocated block thus costs one
+ * word of overhead instead of two.
+ *
+ * A free block of TRIM_THRESHOLD bytes or more at the end of the heap
+ * is given back by shrinking the heap. The pages inside any other free
+ * block of DISCARD_THRESHOLD bytes or more are handed to mem_discard,
+ * which lets an mmap-backed memory system release them while the block
+ * keeps its place in the heap. A free only discards the pages it adds
+ * to such a block, so freeing next to a large free block stays cheap.
+ *
+ * Requests of MMAP_THRESHOLD bytes or more never enter the heap. Each
+ * gets a mapping of its own from mem_map, with a header marked MAPPED
+ * that holds the mapping's length; mm_free unmaps it and mm_realloc
+ * resizes it with mem_remap, which moves pages rather than copying
+ * bytes. The heap itself stays made of small blocks, and a large one
+ * going away leaves no hole in it.
+ *
+ * Payloads are aligned to 16 bytes. Headers, footers and free list
+ * links are 32 bits wide on any target: a link holds the offset of a
+ * block from the start of the heap rather than its address, so the
+ * allocator runs in a 64-bit process with blocks as compact as in a
+ * 32-bit one, for heaps of up to 4G.
+ *
+ * Requests of SLAB_MAX bytes or less are served from slabs instead:
+ * heap blocks of SLAB_SIZE bytes, each holding objects of one size
+ * class (16, 32, 48 or 64 bytes) with no header of their own. A slab
+ * hands out never used objects by bumping an offset and reuses freed
+ * ones from a list threaded through them. Slabs start on SLAB_SIZE
+ * boundaries of the heap, and a page map, one bit per SLAB_SIZE of
+ * heap, tells whether the page a pointer falls in is a slab, whose
+ * header then gives the object size. The map is cut into leaves, heap
+ * blocks allocated when a slab first lands in their range and never
+ * moved, so a pointer's bit stays where it is while the pointer is
+ * live, even for a thread looking in from outside (mm_mt.c).
+ * Each class keeps a list of the slabs that have room; a slab that
+ * empties goes back to the heap unless it is the last one with room.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,24 +84,32 @@ team_t team = {
     ""
 };
 
-/* single word (4) or double word (8) alignment */
-#define ALIGNMENT 8
+/* payloads are aligned for SSE and AVX data */
+#define ALIGNMENT 16
 
 /* rounds up to the nearest multiple of ALIGNMENT */
-#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~0x7)
+#define ALIGN(size) (((size) + (ALIGNMENT-1)) & ~(ALIGNMENT-1))
 
 
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
-/* the maximum heap space is 20M which is more than 24bits, 
- * so at least need 4 bytes to hold the block size and satisfy the allignment.
- */
+/* headers, footers and free list links are 4 bytes: block sizes and
+ * heap offsets up to 4G */
 #define WSIZE 4
 
 #define DSIZE 8
 
+/* a free block needs a header, two free list links and a footer */
 #define MIN_BLK_SIZE 16
 
+/* A mapped block's payload starts this far into its mapping, after its header */
+#define MAP_OFFSET ALIGNMENT
+
+/* the low bits of a header */
+#define ALLOC 0x1
+#define PREV_ALLOC 0x2
+#define MAPPED 0x4
+
 #define PACK(size, alloc) ((size) | (alloc))
 
 #define PUT(ptr, val) (*(uint32_t *)(ptr) = val)
@@ -55,41 +119,130 @@ team_t team = {
 /* When ptr points to header or footer */
 #define GETSIZE(ptr) (GET(ptr) & ~0x7)
 
-#define GETALLOC(ptr) (GET(ptr) & 0x1)
+#define GETALLOC(ptr) (GET(ptr) & ALLOC)
+
+/* When ptr points to a header: is the block before this one allocated */
+#define GETPREVALLOC(ptr) (GET(ptr) & PREV_ALLOC)
+
+#define SETPREVALLOC(ptr) (PUT(ptr, GET(ptr) | PREV_ALLOC))
+
+#define CLEARPREVALLOC(ptr) (PUT(ptr, GET(ptr) & ~PREV_ALLOC))
+
+/* When ptr points to a header: is the block in a mapping of its own */
+#define GETMAPPED(ptr) (GET(ptr) & MAPPED)
 
 /* When ptr points the beginning of the content block, this MACRO finds the pointer of the header */
 #define HDRP(ptr) ((char *)(ptr) - WSIZE)
 
-/* When ptr points the beginning of the content block, this MACRO finds the pointer of the footer */
+/* When ptr points the beginning of a free block, this MACRO finds the pointer of the footer */
 #define FTRP(ptr) (HDRP(ptr) + GETSIZE(HDRP(ptr)) - WSIZE)
 
-#define SETALLOC(ptr) (PUT(ptr, PACK(GETSIZE(ptr), 1)))
-
-#define FREEALLOC(ptr) (PUT(ptr, GETSIZE(ptr)))
-
 /* Move to the beginning of the next content block */
-#define NEXT_BLKP(ptr) (FTRP(ptr) + DSIZE)
+#define NEXT_BLKP(ptr) ((char *)(ptr) + GETSIZE(HDRP(ptr)))
 
-/* Move to the beginning of the last content block */
+/* Move to the beginning of the last content block, only if it is free */
 #define PREV_BLKP(ptr) ((char *)(ptr) - GETSIZE(HDRP(ptr) - WSIZE))
 
+/* The heap offset a link stores for block ptr; offset 0, inside the index, stands for NULL */
+#define OFFSET(ptr) ((ptr) == NULL ? 0 : (uint32_t)((char *)(ptr) - BINS))
+
+/* The block a link holding offset off names */
+#define ADDR(off) ((off) == 0 ? NULL : BINS + (off))
+
 /* Move to the prev free block */
-#define PREV_FREE_BLKP(ptr) ((char *)(*(uint32_t *)(ptr)))
+#define PREV_FREE_BLKP(ptr) ADDR(GET(ptr))
 
 /* Move to the next free block */
-#define NEXT_FREE_BLKP(ptr) ((char *)(*((uint32_t *)(ptr) + 1)))
+#define NEXT_FREE_BLKP(ptr) ADDR(GET((char *)(ptr) + WSIZE))
+
+/* Set the previous free block link in the payload */
+#define SET_PREV_FREE_BLKP(ptr, prev_ptr) (PUT(ptr, OFFSET(prev_ptr)))
+
+/* Set the next free block link in the payload */
+#define SET_NEXT_FREE_BLKP(ptr, next_ptr) (PUT(((char *)(ptr) + WSIZE), OFFSET(next_ptr)))
+
+/* First-level classes: the powers of two 2^4 (the minimum block) to 2^24;
+ * larger blocks, which only fit the heap at all when it is over 16M,
+ * share the very last list */
+#define FL_MIN 4
+#define FL_COUNT 21
+
+/* Each first-level class is split into SL_COUNT second-level ones */
+#define SL_SHIFT 3
+#define SL_COUNT (1 << SL_SHIFT)
+
+/* A free block ending the heap is given back once it is this large */
+#define TRIM_THRESHOLD (128 * 1024)
+
+/* The pages inside a free block this large are discarded */
+#define DISCARD_THRESHOLD (256 * 1024)
+
+/* Requests this large are mapped outside the heap */
+#define MMAP_THRESHOLD (128 * 1024)
+
+/* Requests this small are served from slabs of SLAB_SIZE bytes */
+#define SLAB_MAX 64
+#define SLAB_SIZE 4096
+
+/* Slab size classes, one for every ALIGNMENT bytes up to SLAB_MAX */
+#define NSLABS (SLAB_MAX / ALIGNMENT)
 
-/* Set the previous free block addr in the payload */
-#define SET_PREV_FREE_BLKP(ptr, prev_ptr) (PUT(ptr, (uint32_t) (prev_ptr)))
+/* The slab class of a request of size bytes */
+#define SLAB_CLASS(size) (((size) - 1) / ALIGNMENT)
 
-/* Set the next free block addr in the payload */
-#define SET_NEXT_FREE_BLKP(ptr, next_ptr) (PUT(((char *)(ptr) + WSIZE), (uint32_t) (next_ptr)))
+/* Number of size classes, each with its own free list */
+#define NBINS (FL_COUNT * SL_COUNT)
 
-/* basic pointer for free list */
-static void *free_bp;
+/* free list heads and bitmaps, at the start of the heap */
+#define BINS ((char *)mem_heap_lo())
 
-/* first-match policy */
-static void *find_first_fit(uint32_t bytes);
+/* Address of the head pointer of free list i */
+#define BINP(i) (BINS + (i) * WSIZE)
+
+/* The head (most recently inserted block) of free list i */
+#define BIN_HEAD(i) ADDR(GET(BINP(i)))
+
+/* Bit fl is set when first-level class fl has a non-empty list */
+#define FL_MAPP BINP(NBINS)
+
+/* Address of the head of slab class c's list of slabs with room */
+#define SLAB_HEADP(c) BINP(NBINS + 1 + (c))
+
+/* Page map leaves: each covers MAP_LEAF_PAGES slab-sized pages (32M of
+ * heap), and MAP_LEAVES of them cover a 4G heap */
+#define MAP_LEAF_PAGES 8192
+#define MAP_LEAVES 128
+
+/* The index word holding the offset of page map leaf i, and its address */
+#define MAP_LEAF_WORD(i) (NBINS + 1 + NSLABS + (i))
+#define MAP_LEAFP(i) BINP(MAP_LEAF_WORD(i))
+
+/* The bitmap of non-empty lists in first-level class fl, one byte each */
+#define SL_MAP(fl) (((uint8_t *)BINP(NBINS + 1 + NSLABS + MAP_LEAVES))[fl])
+
+/* Bytes of list heads and bitmaps before the prologue block, a multiple of ALIGNMENT */
+#define INDEX_SIZE ALIGN((NBINS + 1 + NSLABS + MAP_LEAVES) * WSIZE + FL_COUNT)
+
+/* The start of a slab's payload; its objects follow */
+typedef struct {
+    uint16_t size;      /* of its objects */
+    uint16_t used;      /* objects handed out */
+    uint16_t free;      /* offset of the first freed object, 0 if none */
+    uint16_t bump;      /* offset of the first never used object */
+    uint32_t prev;      /* its neighbours in its class's list of slabs with room */
+    uint32_t next;
+} slab_t;
+
+/* The offset of the object after a freed one in its slab, in the object */
+#define NEXT_OBJ(obj) (*(uint16_t *)(obj))
+
+static int bin_index(uint32_t size);
+
+static int next_bin(int i);
+
+static void bin_mark(int i);
+
+static void bin_unmark(int i);
 
 /* find-best policy */
 static void *find_best_fit(uint32_t bytes);
@@ -104,6 +257,38 @@ static void *coalesce(void *ptr);
 
 static void *incr_heap(uint32_t bytes);
 
+static uint32_t blk_size(size_t size);
+
+static int trim_heap(void *ptr);
+
+static void discard(void *ptr, char *lo, char *hi);
+
+static size_t map_size(size_t size);
+
+static void *map_blk(size_t size);
+
+static void *remap_blk(void *ptr, size_t size);
+
+static void *alloc_blk(uint32_t size);
+
+static void free_blk(void *ptr);
+
+static slab_t *slab_of(void *ptr);
+
+static void *slab_malloc(size_t size);
+
+static void slab_free(slab_t *s, void *obj);
+
+static slab_t *new_slab(int c);
+
+static int slab_full(slab_t *s);
+
+static void slab_link(slab_t *s);
+
+static void slab_unlink(slab_t *s);
+
+static int page_mark(uint32_t page, int slab);
+
 /* helper function to print the block list */
 static void printBlock();
 
@@ -113,25 +298,27 @@ static void printBlock();
  */
 int mm_init(void)
 {
-    void *ptr = mem_sbrk(16);
-    if (ptr == NULL)
+    char *ptr = mem_sbrk(INDEX_SIZE + 16);
+    if (ptr == (void *)-1)
         return -1;
+    /* the free list heads and bitmaps come first, all lists empty */
+    memset(ptr, 0, INDEX_SIZE);
+    ptr += INDEX_SIZE;
     /* first 4 bytes are skipped for allignment */
     /* put header */
-    PUT(ptr + WSIZE, PACK(DSIZE, 1));
+    PUT(ptr + WSIZE, PACK(DSIZE, ALLOC | PREV_ALLOC));
     /* put footer */
-    PUT(ptr + DSIZE, PACK(DSIZE, 1));
+    PUT(ptr + DSIZE, PACK(DSIZE, ALLOC | PREV_ALLOC));
     /* put dummy end header */
-    PUT(ptr + WSIZE + DSIZE, PACK(0, 1));
-
-    /* Initially, no free block */
-    free_bp = NULL;
+    PUT(ptr + WSIZE + DSIZE, PACK(0, ALLOC | PREV_ALLOC));
     return 0;
 }
 
 /* 
- * mm_malloc - Allocate a block by traveling through all the blocks.
- *     
+ * mm_malloc - Allocate a small request from a slab, a large one from a
+ *     mapping of its own, and any other from the best fitting free
+ *     block of the smallest size class that has one, growing the heap
+ *     if none does.
  */
 void *mm_malloc(size_t size)
 {
@@ -139,27 +326,33 @@ void *mm_malloc(size_t size)
     if (size == 0)
         return NULL;
 
-    /* include header and footer, plus 2 pointers space */
-    size += DSIZE * 2;
+    if (size <= SLAB_MAX)
+        return slab_malloc(size);
 
-    /* align the size by 8 */
-    size = ALIGN(size);
+    if (size >= MMAP_THRESHOLD)
+        return map_blk(size);
 
+    /* include the header, align by 16 */
+    return alloc_blk(blk_size(size));
+}
+
+/* allocate a heap block of size bytes, a multiple of ALIGNMENT */
+static void *alloc_blk(uint32_t size) {
     /* Search the suitable block */
-    // char *ptr = (char *)find_first_fit(size);
     char *ptr = (char *)find_best_fit(size);
 
     /* increase heap if no suitable block */
     if (ptr == NULL) {
         ptr = (char *)incr_heap(size);
+        if (ptr == NULL)
+            return NULL;
     }
 
     /* move the block pointed by ptr out of free list */
     move_blk_out_of_free_list(ptr);
 
     /* see if we can split the block. Set up the alloc bits here as well no matter if we can split or not.*/
-    if (ptr != NULL)
-        split(ptr, size);
+    split(ptr, size);
 
     // printf("%s %d\n", "Finish alloc", size);
     // printBlock();
@@ -168,21 +361,59 @@ void *mm_malloc(size_t size)
 }
 
 /*
- * mm_free - Freeing a block does nothing.
+ * mm_free - Free a block, coalesce it with free neighbours and give
+ *     large free space back to the memory system.
  */
 void mm_free(void *ptr)
 {
-    FREEALLOC(HDRP(ptr));
-    FREEALLOC(FTRP(ptr));
+    slab_t *s;
+
+    if ((s = slab_of(ptr)) != NULL) {
+        slab_free(s, ptr);
+        return;
+    }
+
+    if (GETMAPPED(HDRP(ptr))) {
+        mem_unmap((char *)ptr - MAP_OFFSET, GETSIZE(HDRP(ptr)));
+        return;
+    }
+
+    free_blk(ptr);
+}
+
+/* free a heap block */
+static void free_blk(void *ptr) {
+    char *lo = ptr, *hi = NEXT_BLKP(ptr);
+
+    /* A free neighbour this large had its pages discarded already; a smaller one joins the span to discard */
+    if (!GETPREVALLOC(HDRP(ptr)) && GETSIZE(HDRP(PREV_BLKP(ptr))) < DISCARD_THRESHOLD)
+        lo = PREV_BLKP(ptr);
+    if (!GETALLOC(HDRP(hi)) && GETSIZE(HDRP(hi)) < DISCARD_THRESHOLD)
+        hi = NEXT_BLKP(hi);
+
+    PUT(HDRP(ptr), GET(HDRP(ptr)) & ~ALLOC);
+    PUT(FTRP(ptr), GET(HDRP(ptr)));
+    CLEARPREVALLOC(HDRP(NEXT_BLKP(ptr)));
     void* new_ptr = coalesce(ptr);
+    if (trim_heap(new_ptr))
+        return;
     insert_free_list(new_ptr);
+    if (GETSIZE(HDRP(new_ptr)) >= DISCARD_THRESHOLD)
+        discard(new_ptr, lo, hi);
 
     // printf("%s\n", "finish free");
     // printBlock();
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * mm_realloc - Resize in place when possible: shrink by splitting,
+ *     grow into a free next block or, at the end of the heap, into
+ *     newly sbrk'd space, all without copying. Only then merge with
+ *     a free previous block (moving the payload down), and as a last
+ *     resort fall back to mm_malloc, memcpy and mm_free. A block
+ *     growing to MMAP_THRESHOLD bytes moves to a mapping, and a mapped
+ *     one is remapped, or moved back into the heap if it gets small. A
+ *     slab object stays put while the request fits its size class.
  */
 void *mm_realloc(void *ptr, size_t size)
 {
@@ -196,16 +427,26 @@ void *mm_realloc(void *ptr, size_t size)
 
     void *newptr;
     size_t copySize;
+    slab_t *s;
+
+    if ((s = slab_of(ptr)) != NULL) {
+        if (size <= s->size)
+            return ptr;
+        if ((newptr = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(newptr, ptr, s->size);
+        mm_free(ptr);
+        return newptr;
+    }
 
-    copySize = GETSIZE(HDRP(ptr)) - DSIZE;
+    if (GETMAPPED(HDRP(ptr)))
+        return remap_blk(ptr, size);
+
+    copySize = GETSIZE(HDRP(ptr)) - WSIZE;
     /* if size is smaller than copySize, no need to malloc */
     if (size < copySize) {
-        /* keep header and footer */
-        if (size + DSIZE < MIN_BLK_SIZE) 
-            size = MIN_BLK_SIZE;
-        else 
-            size = ALIGN(size + DSIZE);
-        split(ptr, size);
+        /* keep the header */
+        split(ptr, blk_size(size));
         newptr = ptr;
 
         // printf("%s: %d\n", "rellocate smaller size", size);
@@ -215,65 +456,58 @@ void *mm_realloc(void *ptr, size_t size)
     } else {
         /* try to use the blocks next to the curr block if they are free */
         char *nxt_blk = NEXT_BLKP(ptr);
-        char *last_blk = PREV_BLKP(ptr);
         uint32_t nxt_blk_alloc = GETALLOC(HDRP(nxt_blk));
-        uint32_t prev_blk_alloc = GETALLOC(HDRP(last_blk));
+        uint32_t prev_blk_alloc = GETPREVALLOC(HDRP(ptr));
+        char *last_blk = prev_blk_alloc? NULL: PREV_BLKP(ptr);
         uint32_t nxt_blk_sz = nxt_blk_alloc? 0: GETSIZE(HDRP(nxt_blk));
         uint32_t prev_blk_sz = prev_blk_alloc? 0: GETSIZE(HDRP(last_blk));
         uint32_t curr_blk_sz = GETSIZE(HDRP(ptr));
         uint32_t total_sz = prev_blk_sz + curr_blk_sz + nxt_blk_sz;
-        uint32_t new_assign_size = ALIGN(size + DSIZE);
-
-        if (total_sz >= new_assign_size) {
-            /* set up new pointer */
-            if (!prev_blk_alloc) 
-                newptr = last_blk;
-            else
-                newptr = ptr;
-                
-            /* set up header */
-            if (!prev_blk_alloc) 
-                PUT(HDRP(last_blk), total_sz);
-            else
-                PUT(HDRP(ptr), total_sz);
-
-            /* set up footer */
+        uint32_t new_assign_size = blk_size(size);
+        int big = size >= MMAP_THRESHOLD;
+
+        /* the block ends the heap, maybe behind one free block, when the dummy end header follows */
+        char *end_blk = nxt_blk_alloc? nxt_blk: NEXT_BLKP(nxt_blk);
+        uint32_t at_top = GETSIZE(HDRP(end_blk)) == 0;
+
+        if (!big && curr_blk_sz + nxt_blk_sz >= new_assign_size) {
+            /* growing forward into the next block keeps the payload where it is */
+            newptr = ptr;
+            move_blk_out_of_free_list(nxt_blk);
+            PUT(HDRP(ptr), PACK(curr_blk_sz + nxt_blk_sz, prev_blk_alloc));
+            split(ptr, new_assign_size);
+
+        } else if (!big && at_top) {
+            /* extend the heap right behind the block, just by what is missing */
+            if (mem_sbrk(new_assign_size - curr_blk_sz - nxt_blk_sz) == (void *)-1)
+                return NULL;
+            newptr = ptr;
             if (!nxt_blk_alloc)
-                PUT(FTRP(nxt_blk),total_sz);
-            else
-                PUT(FTRP(ptr), total_sz);
+                move_blk_out_of_free_list(nxt_blk);
+            PUT(HDRP(ptr), PACK(new_assign_size, prev_blk_alloc | ALLOC));
+            /* set up the ending dummy header */
+            PUT(HDRP(NEXT_BLKP(ptr)), PACK(0, ALLOC | PREV_ALLOC));
+
+        } else if (!big && total_sz >= new_assign_size) {
+            newptr = last_blk;
 
-            /* move the blocks out of free list*/
-            if (!prev_blk_alloc)
-                move_blk_out_of_free_list(last_blk);
+            /* move the blocks out of free list while their sizes still name their lists */
+            move_blk_out_of_free_list(last_blk);
             if (!nxt_blk_alloc)
                 move_blk_out_of_free_list(nxt_blk);
 
-            /* copy the content of current block to the beginning of the prev block */
-            if (newptr == last_blk) {
-                char *dst_ptr = last_blk;
-                char *src_ptr = ptr;
-                uint32_t copy_step = prev_blk_sz >= copySize? copySize: prev_blk_sz;
-                uint32_t nsize = 0;
-                while (nsize + copy_step <= copySize) {
-                    memcpy(dst_ptr, src_ptr, copy_step);
-                    // printf("blk_sz: %d, dst: %p, src: %p, end_dst: %p\n", prev_blk_sz, dst_ptr, src_ptr, dst_ptr + copy_step);
-                    // fflush(stdout);
-                    dst_ptr += copy_step;
-                    src_ptr += copy_step;
-                    nsize += copy_step;
-                }
-                if (nsize < copySize) {
-                    // printf("dst: %p, src: %p, end_dst: %p, footer: %p\n", dst_ptr, src_ptr, dst_ptr + copySize - nsize, FTRP(last_blk));
-                    // fflush(stdout);
-                    memcpy(dst_ptr, src_ptr, copySize - nsize);
-                }
-            }
+            /* set up header, marked free until split; no footer needed */
+            PUT(HDRP(last_blk), PACK(total_sz, GETPREVALLOC(HDRP(last_blk))));
+
+            /* move the content down to the beginning of the prev block; the two may overlap */
+            memmove(last_blk, ptr, copySize);
+
             /* set up alloc and the optional further split */
             split(newptr, new_assign_size);
-            
+
         } else {
-            newptr = mm_malloc(size);
+            if ((newptr = mm_malloc(size)) == NULL)
+                return NULL;
             memcpy(newptr, ptr, copySize);
             mm_free(ptr);
         }
@@ -283,81 +517,364 @@ void *mm_realloc(void *ptr, size_t size)
     return newptr;
 }
 
+/*
+ * mm_usable_size - the number of payload bytes the block at ptr can hold
+ */
+size_t mm_usable_size(void *ptr)
+{
+    slab_t *s;
 
-static void *find_first_fit(uint32_t bytes) {
+    if ((s = slab_of(ptr)) != NULL)
+        return s->size;
+    if (GETMAPPED(HDRP(ptr)))
+        return GETSIZE(HDRP(ptr)) - MAP_OFFSET;
+    return GETSIZE(HDRP(ptr)) - WSIZE;
+}
 
-    char *ptr = (char *)free_bp;
 
-    /* if block is allocated or the size of the block is smaller than required, keep moving */
-    while ((ptr != NULL) && (GETSIZE(HDRP(ptr)) < bytes)) {
-        ptr = PREV_FREE_BLKP(ptr);
+/* the size class of a block of size bytes */
+static int bin_index(uint32_t size) {
+    int fl = 31 - __builtin_clz(size);
+    int sl = (size >> (fl - SL_SHIFT)) & (SL_COUNT - 1);
+    if (fl >= FL_MIN + FL_COUNT)
+        return NBINS - 1;
+    return (fl - FL_MIN) * SL_COUNT + sl;
+}
+
+/* the first non-empty size class above class i, or -1 if there is none */
+static int next_bin(int i) {
+    int fl = i / SL_COUNT;
+    uint32_t map = SL_MAP(fl) & (~0u << (i % SL_COUNT) << 1);
+
+    if (map == 0) {
+        map = GET(FL_MAPP) & (~0u << fl << 1);
+        if (map == 0)
+            return -1;
+        fl = __builtin_ctz(map);
+        map = SL_MAP(fl);
     }
-    
-    return ptr;
+    return fl * SL_COUNT + __builtin_ctz(map);
+}
+
+/* record that free list i became non-empty */
+static void bin_mark(int i) {
+    int fl = i / SL_COUNT;
+    SL_MAP(fl) |= 1u << (i % SL_COUNT);
+    PUT(FL_MAPP, GET(FL_MAPP) | (1u << fl));
+}
+
+/* record that free list i became empty */
+static void bin_unmark(int i) {
+    int fl = i / SL_COUNT;
+    SL_MAP(fl) &= ~(1u << (i % SL_COUNT));
+    if (SL_MAP(fl) == 0)
+        PUT(FL_MAPP, GET(FL_MAPP) & ~(1u << fl));
 }
 
 static void *find_best_fit(uint32_t bytes) {
-    char *ptr = (char *)free_bp;
+    int i = bin_index(bytes);
+    char *ptr;
     char *best_fit = NULL;
     uint32_t best_size = UINT32_MAX;
     uint32_t blk_size;
-    /* if block is allocated or the size of the block is smaller than required, keep moving */
-    while (ptr != NULL) {
+
+    /* the best fit in the class of bytes; an exact fit can't be beaten */
+    for (ptr = BIN_HEAD(i); ptr != NULL; ptr = PREV_FREE_BLKP(ptr)) {
         blk_size = GETSIZE(HDRP(ptr));
-        if (blk_size >= bytes) {
-            if (best_fit == NULL || blk_size < best_size) {
-                best_size = blk_size;
-                best_fit = ptr;
-            }
+        if (blk_size >= bytes && blk_size < best_size) {
+            best_size = blk_size;
+            best_fit = ptr;
+            if (blk_size == bytes)
+                break;
         }
-        ptr = PREV_FREE_BLKP(ptr);
     }
-    
-    /* no available block */
-    return best_fit;
+    if (best_fit != NULL)
+        return best_fit;
+
+    /* every block in a higher class fits; take one from the closest */
+    if ((i = next_bin(i)) < 0)
+        return NULL;
+    return BIN_HEAD(i);
+}
+
+/* the block size for a payload of size bytes: a header, aligned by 16 */
+static uint32_t blk_size(size_t size) {
+    size = ALIGN(size + WSIZE);
+    return size < MIN_BLK_SIZE ? MIN_BLK_SIZE : size;
 }
 
 static void split(void *ptr, uint32_t bytes) {
     uint32_t blk_size = GETSIZE(HDRP(ptr));
     uint32_t left_size;
-    /* if we have more than 8 bytes(header + footer) left, split the block */
+    /* if we have at least a minimum free block left, split the block */
     if ((blk_size > bytes) && ((left_size = blk_size - bytes) >= MIN_BLK_SIZE)) {
-        PUT(HDRP(ptr), PACK(bytes, 1));
-        PUT(FTRP(ptr), PACK(bytes, 1));
+        PUT(HDRP(ptr), PACK(bytes, GETPREVALLOC(HDRP(ptr)) | ALLOC));
         char *nxt_blk = NEXT_BLKP(ptr);
         // printf("\n%p, %p, %d, %d, %d\n", ptr, nxt_blk, left_size, blk_size, bytes);
 
         /* insert the remaining block back to free list*/
-        PUT(HDRP(nxt_blk), left_size);
-        PUT(FTRP(nxt_blk), left_size);
+        PUT(HDRP(nxt_blk), PACK(left_size, PREV_ALLOC));
+        PUT(FTRP(nxt_blk), PACK(left_size, PREV_ALLOC));
+        CLEARPREVALLOC(HDRP(NEXT_BLKP(nxt_blk)));
         /* normal malloc doesn't need the coalesce since every time calling free will call coalesce. */
         /* But for realloc and the realloc size is smaller than original, then the split block might coalesce with the next block */
         coalesce(nxt_blk);
         insert_free_list(nxt_blk);
     } else {
-        SETALLOC(HDRP(ptr));
-        SETALLOC(FTRP(ptr));
+        PUT(HDRP(ptr), GET(HDRP(ptr)) | ALLOC);
+        SETPREVALLOC(HDRP(NEXT_BLKP(ptr)));
     }
 }
 
+/* shrink the heap by the free block ptr if it is large and ends the heap; returns 1 if it did */
+static int trim_heap(void *ptr) {
+    uint32_t size = GETSIZE(HDRP(ptr));
+
+    if (size < TRIM_THRESHOLD || GETSIZE(HDRP(NEXT_BLKP(ptr))) != 0)
+        return 0;
+    if (mem_sbrk(-(int)size) == (void *)-1)
+        return 0;
+    /* the block's header becomes the ending dummy header; the block before it is allocated */
+    PUT(HDRP(ptr), PACK(0, ALLOC | PREV_ALLOC));
+    return 1;
+}
+
+/*
+ * discard the whole pages of a free block between its free list links
+ * and its footer that touch [lo, hi), the part that wasn't discarded
+ * before; a free then costs time for the bytes it frees, not for the
+ * size of the free block it joins
+ */
+static void discard(void *ptr, char *lo, char *hi) {
+    uintptr_t page = mem_pagesize();
+    uintptr_t start = ((uintptr_t)ptr + DSIZE + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t)FTRP(ptr) & ~(page - 1);
+
+    if (start < ((uintptr_t)lo & ~(page - 1)))
+        start = (uintptr_t)lo & ~(page - 1);
+    if (end > (((uintptr_t)hi + page - 1) & ~(page - 1)))
+        end = ((uintptr_t)hi + page - 1) & ~(page - 1);
+
+    if (end > start)
+        mem_discard((void *)start, end - start);
+}
+
+/* the length of the mapping for a payload of size bytes, or 0 if a header can't hold it */
+static size_t map_size(size_t size) {
+    size_t page = getpagesize();
+
+    if (size > UINT32_MAX - MAP_OFFSET - page)
+        return 0;
+    return (size + MAP_OFFSET + page - 1) & ~(page - 1);
+}
+
+/* map a block for size bytes: padding, the header and the payload */
+static void *map_blk(size_t size) {
+    size_t len = map_size(size);
+    char *p;
+
+    if (len == 0 || (p = mem_map(len)) == (void *)-1)
+        return NULL;
+    PUT(HDRP(p + MAP_OFFSET), PACK(len, ALLOC | MAPPED));
+    return p + MAP_OFFSET;
+}
+
+/* resize the mapped block ptr, moving it back into the heap when it drops below the threshold */
+static void *remap_blk(void *ptr, size_t size) {
+    uint32_t len = GETSIZE(HDRP(ptr));
+    size_t new_len = map_size(size);
+    char *p;
+
+    if (size < MMAP_THRESHOLD) {
+        if ((p = mm_malloc(size)) == NULL)
+            return NULL;
+        memcpy(p, ptr, size);
+        mm_free(ptr);
+        return p;
+    }
+    if (new_len == 0)
+        return NULL;
+    if (new_len == len)
+        return ptr;
+    if ((p = mem_remap((char *)ptr - MAP_OFFSET, len, new_len)) == (void *)-1)
+        return NULL;
+    PUT(HDRP(p + MAP_OFFSET), PACK(new_len, ALLOC | MAPPED));
+    return p + MAP_OFFSET;
+}
+
+/* the slab holding ptr, or NULL if ptr isn't in one; every free asks, so the heap start is looked up once */
+static slab_t *slab_of(void *ptr) {
+    char *base = BINS;
+    uintptr_t page = (uintptr_t)((char *)ptr - base) / SLAB_SIZE;
+    uint32_t leaf;
+
+    if (page >= (uintptr_t)MAP_LEAVES * MAP_LEAF_PAGES)
+        return NULL;
+    leaf = GET(base + MAP_LEAF_WORD(page / MAP_LEAF_PAGES) * WSIZE);
+    if (leaf == 0 || !(base[leaf + page % MAP_LEAF_PAGES / 8] & (1u << (page % 8))))
+        return NULL;
+    return (slab_t *)(base + page * SLAB_SIZE);
+}
+
+/* take an object from the first slab of its class with room, making a slab if there is none */
+static void *slab_malloc(size_t size) {
+    int c = SLAB_CLASS(size);
+    slab_t *s = (slab_t *)ADDR(GET(SLAB_HEADP(c)));
+    char *obj;
+
+    if (s == NULL && (s = new_slab(c)) == NULL)
+        return NULL;
+    if (s->free != 0) {
+        obj = (char *)s + s->free;
+        s->free = NEXT_OBJ(obj);
+    } else {
+        obj = (char *)s + s->bump;
+        s->bump += s->size;
+    }
+    s->used++;
+    if (slab_full(s))
+        slab_unlink(s);
+    return obj;
+}
+
+/* give obj back to its slab, and an emptied slab back to the heap unless it is the only one with room */
+static void slab_free(slab_t *s, void *obj) {
+    uint32_t page = ((char *)s - BINS) / SLAB_SIZE;
+
+    if (slab_full(s))
+        slab_link(s);
+    NEXT_OBJ(obj) = s->free;
+    s->free = (char *)obj - (char *)s;
+    if (--s->used > 0)
+        return;
+    if (s->prev == 0 && s->next == 0) {
+        /* keep it, as good as new */
+        s->free = 0;
+        s->bump = sizeof(slab_t);
+        return;
+    }
+    slab_unlink(s);
+    page_mark(page, 0);
+    free_blk(s);
+}
+
+/* carve a slab for class c out of a heap block starting on a SLAB_SIZE boundary */
+static slab_t *new_slab(int c) {
+    char *ptr = (char *)find_best_fit(2 * SLAB_SIZE);
+    uint32_t lead, total, page;
+    slab_t *s;
+
+    /* any block of twice the slab size holds an aligned slab; failing
+       one, grow the heap just enough for one behind whatever ends it */
+    if (ptr == NULL) {
+        ptr = (char *)mem_heap_hi() + 1;
+        if (!GETPREVALLOC(HDRP(ptr)))
+            ptr = PREV_BLKP(ptr);
+        total = (SLAB_SIZE - OFFSET(ptr) % SLAB_SIZE) % SLAB_SIZE + SLAB_SIZE;
+        if ((GETALLOC(HDRP(ptr)) || GETSIZE(HDRP(ptr)) < total) &&
+            (ptr = (char *)incr_heap(total)) == NULL)
+            return NULL;
+    }
+    move_blk_out_of_free_list(ptr);
+
+    /* the part before the boundary, a multiple of ALIGNMENT, becomes a free block of its own */
+    lead = (SLAB_SIZE - OFFSET(ptr) % SLAB_SIZE) % SLAB_SIZE;
+    if (lead != 0) {
+        total = GETSIZE(HDRP(ptr));
+        PUT(HDRP(ptr), PACK(lead, GETPREVALLOC(HDRP(ptr))));
+        PUT(FTRP(ptr), GET(HDRP(ptr)));
+        insert_free_list(ptr);
+        ptr += lead;
+        PUT(HDRP(ptr), PACK(total - lead, 0));
+    }
+    split(ptr, SLAB_SIZE);
+
+    page = OFFSET(ptr) / SLAB_SIZE;
+    if (page_mark(page, 1) < 0) {
+        free_blk(ptr);
+        return NULL;
+    }
+
+    s = (slab_t *)ptr;
+    s->size = (c + 1) * ALIGNMENT;
+    s->used = 0;
+    s->free = 0;
+    s->bump = sizeof(slab_t);
+    s->prev = s->next = 0;
+    slab_link(s);
+    return s;
+}
+
+/* a slab is full when it has neither a freed nor a never used object left */
+static int slab_full(slab_t *s) {
+    return s->free == 0 && s->bump + s->size > SLAB_SIZE - WSIZE;
+}
+
+/* put s at the head of its class's list of slabs with room */
+static void slab_link(slab_t *s) {
+    char *headp = SLAB_HEADP(SLAB_CLASS(s->size));
+    slab_t *head = (slab_t *)ADDR(GET(headp));
+
+    s->prev = 0;
+    s->next = OFFSET(head);
+    if (head != NULL)
+        head->prev = OFFSET(s);
+    PUT(headp, OFFSET(s));
+}
+
+/* take s off its class's list of slabs with room */
+static void slab_unlink(slab_t *s) {
+    if (s->next != 0)
+        ((slab_t *)ADDR(s->next))->prev = s->prev;
+    if (s->prev != 0)
+        ((slab_t *)ADDR(s->prev))->next = s->next;
+    else
+        PUT(SLAB_HEADP(SLAB_CLASS(s->size)), s->next);
+    s->prev = s->next = 0;
+}
+
+/* set or clear the page map bit of heap page page, allocating its leaf if need be; returns -1 on error */
+static int page_mark(uint32_t page, int slab) {
+    char *leafp;
+    uint8_t *leaf;
+
+    if (page >= (uint32_t)MAP_LEAVES * MAP_LEAF_PAGES)
+        return -1;
+    leafp = MAP_LEAFP(page / MAP_LEAF_PAGES);
+    leaf = (uint8_t *)ADDR(GET(leafp));
+    if (leaf == NULL) {
+        if ((leaf = (uint8_t *)alloc_blk(blk_size(MAP_LEAF_PAGES / 8))) == NULL)
+            return -1;
+        memset(leaf, 0, MAP_LEAF_PAGES / 8);
+        PUT(leafp, OFFSET(leaf));
+    }
+    page %= MAP_LEAF_PAGES;
+    if (slab)
+        leaf[page / 8] |= 1u << (page % 8);
+    else
+        leaf[page / 8] &= ~(1u << (page % 8));
+    return 0;
+}
+
 static void *incr_heap(uint32_t bytes) {
     // void *bp = mem_sbrk(mem_pagesize());
 
     /* if the prev block is not allocated, only assign bytes - (size of prev block) */
-    char *heap_top_footer = (char *)mem_heap_hi() + 1 - DSIZE;
+    char *heap_top_header = (char *)mem_heap_hi() + 1 - WSIZE;
+    uint32_t prev_alloc = GETPREVALLOC(heap_top_header);
   
-    if (!GETALLOC(heap_top_footer))
-        bytes -= GETSIZE(heap_top_footer);
+    if (!prev_alloc)
+        bytes -= GETSIZE(heap_top_header - WSIZE);
 
     char *bp = (char *) mem_sbrk(bytes);
     if (bp == (void *)-1) {
         return NULL;
     }
-    /* set up header and footer */
-    PUT(bp - WSIZE, bytes);
-    PUT(bp + bytes - DSIZE, bytes);
+    /* set up header and footer over the old ending dummy header */
+    PUT(bp - WSIZE, PACK(bytes, prev_alloc));
+    PUT(bp + bytes - DSIZE, PACK(bytes, prev_alloc));
     /* set up the ending dummy header */
-    PUT(bp + bytes - WSIZE, PACK(0, 1));
+    PUT(bp + bytes - WSIZE, PACK(0, ALLOC));
     bp = coalesce(bp);
 
     /* insert free block at the head of free list */
@@ -366,74 +883,85 @@ static void *incr_heap(uint32_t bytes) {
     return bp;
 }
 
+/* The block's list is found from its size, so call this before the header changes */
 static void move_blk_out_of_free_list(void *ptr) {
     char *prev_free_blk_ptr = PREV_FREE_BLKP(ptr);
     char *nxt_free_blk_ptr = NEXT_FREE_BLKP(ptr);
+    int i;
     if (nxt_free_blk_ptr != NULL)
         SET_PREV_FREE_BLKP(nxt_free_blk_ptr, prev_free_blk_ptr);
     if (prev_free_blk_ptr != NULL)
         SET_NEXT_FREE_BLKP(prev_free_blk_ptr, nxt_free_blk_ptr);
-    /* if the next free block ptr is NULL, meaning the block is the head in the free list, set free_ptr to the prev block */
-    if (nxt_free_blk_ptr == NULL)
-        free_bp = prev_free_blk_ptr;
+    /* if the next free block ptr is NULL, meaning the block is the head in its list, make the prev block the head */
+    if (nxt_free_blk_ptr == NULL) {
+        i = bin_index(GETSIZE(HDRP(ptr)));
+        PUT(BINP(i), OFFSET(prev_free_blk_ptr));
+        if (prev_free_blk_ptr == NULL)
+            bin_unmark(i);
+    }
 }
 
 static void insert_free_list(void *ptr) {
-    SET_PREV_FREE_BLKP(ptr, free_bp);
+    int i = bin_index(GETSIZE(HDRP(ptr)));
+    char *head = BIN_HEAD(i);
+    SET_PREV_FREE_BLKP(ptr, head);
     SET_NEXT_FREE_BLKP(ptr, 0);
-    if (free_bp != NULL)
-        SET_NEXT_FREE_BLKP(free_bp, ptr);
-    free_bp = ptr;
+    if (head != NULL)
+        SET_NEXT_FREE_BLKP(head, ptr);
+    else
+        bin_mark(i);
+    PUT(BINP(i), OFFSET(ptr));
 }
 
+/* ptr is a free block with header and footer set; the next header already says it is free */
 static void *coalesce(void *ptr) {
-    char *last_blk = PREV_BLKP(ptr);
     char *nxt_blk = NEXT_BLKP(ptr);
-    uint32_t last_blk_alloc = GETALLOC(HDRP(last_blk));
+    uint32_t last_blk_alloc = GETPREVALLOC(HDRP(ptr));
     uint32_t nxt_blk_alloc = GETALLOC(HDRP(nxt_blk));
+    char *last_blk = last_blk_alloc? NULL: PREV_BLKP(ptr);
    
     if (last_blk_alloc && nxt_blk_alloc) 
         return ptr;
     else if (last_blk_alloc && (!nxt_blk_alloc)) {
         uint32_t nxt_blk_sz = GETSIZE(HDRP(nxt_blk));
         uint32_t curr_blk_sz = GETSIZE(HDRP(ptr));
-        /* update the header and footer */
-        PUT(HDRP(ptr), curr_blk_sz + nxt_blk_sz);
-        PUT(FTRP(nxt_blk), curr_blk_sz + nxt_blk_sz);
         /* move the next block out of free list */
         move_blk_out_of_free_list(nxt_blk);
+        /* update the header and footer */
+        PUT(HDRP(ptr), PACK(curr_blk_sz + nxt_blk_sz, PREV_ALLOC));
+        PUT(FTRP(ptr), PACK(curr_blk_sz + nxt_blk_sz, PREV_ALLOC));
         return ptr;
     } else if ((!last_blk_alloc) && nxt_blk_alloc) {
         uint32_t prev_blk_sz = GETSIZE(HDRP(last_blk));
         uint32_t curr_blk_sz = GETSIZE(HDRP(ptr));
-        /* update the header and footer */
-        PUT(HDRP(last_blk), curr_blk_sz + prev_blk_sz);
-        PUT(FTRP(ptr), curr_blk_sz + prev_blk_sz);
         /* move the prev block out of free list */
         move_blk_out_of_free_list(last_blk);
+        /* update the header and footer; two free blocks are never adjacent, so the block before last_blk is allocated */
+        PUT(HDRP(last_blk), PACK(curr_blk_sz + prev_blk_sz, PREV_ALLOC));
+        PUT(FTRP(last_blk), PACK(curr_blk_sz + prev_blk_sz, PREV_ALLOC));
         return last_blk;
     } else {
         uint32_t nxt_blk_sz = GETSIZE(HDRP(nxt_blk));
         uint32_t prev_blk_sz = GETSIZE(HDRP(last_blk));
         uint32_t curr_blk_sz = GETSIZE(HDRP(ptr));
-        /* update the header and footer */
-        PUT(HDRP(last_blk), curr_blk_sz + prev_blk_sz + nxt_blk_sz);
-        PUT(FTRP(nxt_blk), curr_blk_sz + prev_blk_sz + nxt_blk_sz);
         /* move the two blocks out of free list */
         move_blk_out_of_free_list(last_blk);
         move_blk_out_of_free_list(nxt_blk);
+        /* update the header and footer */
+        PUT(HDRP(last_blk), PACK(curr_blk_sz + prev_blk_sz + nxt_blk_sz, PREV_ALLOC));
+        PUT(FTRP(last_blk), PACK(curr_blk_sz + prev_blk_sz + nxt_blk_sz, PREV_ALLOC));
         return last_blk;
     }
     
 }
 
-
 static void printBlock() {
-    char *ptr = (char *)mem_heap_lo();
+    char *ptr = BINS + INDEX_SIZE;
     ptr += DSIZE;
     char *ptr_end = (char *)mem_heap_hi();
     while (ptr <= ptr_end) {
-        printf("[%p, %d, %d]=>", ptr, GETSIZE(HDRP(ptr)), GETALLOC(HDRP(ptr)));
+        printf("[%p, %d, %d, %d]=>", ptr, GETSIZE(HDRP(ptr)), GETALLOC(HDRP(ptr)),
+               GETPREVALLOC(HDRP(ptr)) != 0);
         ptr = NEXT_BLKP(ptr);
     }
     printf("%s\n", "");
@@ -0,0 +1,352 @@
+/*
+ * mm_mt.c - thread-safe allocator with one mm.c heap per thread
+ *
+ * mm.c keeps all of its state inside the heap it is given, and finds
+ * that heap through the memlib interface (mem_sbrk, mem_heap_lo,
+ * mem_heap_hi). This file provides that interface itself, so that
+ * each thread sees a heap of its own, an arena: a region of
+ * ARENA_SIZE bytes of address space, aligned to its size, with the
+ * arena's descriptor at the start and the mm.c heap behind it. Link it
+ * with mm.o instead of memlib.o.
+ *
+ * Only the thread that owns an arena ever runs mm.c on it, so the fast
+ * paths take no locks:
+ *
+ *   - mt_free of a block from the caller's own arena pushes small
+ *     blocks onto a per-size thread cache (tcache) without touching
+ *     the heap, and hands others to mm_free;
+ *   - mt_malloc pops from the tcache first and calls mm_malloc only
+ *     when it is empty;
+ *   - a block freed by a thread that doesn't own it is pushed onto its
+ *     arena's remote-free list, a lock-free stack found by masking the
+ *     block's address. The owner takes the whole list with one atomic
+ *     exchange the next time it allocates or frees, and frees the
+ *     blocks into its heap.
+ *
+ * When a thread exits its arena is released, tcache and all, and the
+ * next thread without an arena adopts it instead of mapping a new one.
+ * Pages an arena's heap gives up, by shrinking or through mem_discard,
+ * are released with madvise(MADV_DONTNEED), so a thread's resident
+ * memory follows what it has allocated rather than its peak. Blocks
+ * mm.c maps on their own belong to no arena, which is how they are
+ * told apart: any thread frees them straight back to the kernel.
+ * The list of arenas is the only thing guarded by a lock.
+ */
+#define _GNU_SOURCE  /* for mremap */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "mm_mt.h"
+
+typedef struct arena {
+    struct arena *next;       /* All arenas, linked under arenas_lock */
+    int owned;                /* A live thread uses it */
+    int initialized;          /* mm_init has run on it */
+    char *lo;                 /* First heap byte */
+    char *brk;                /* Heap end */
+    char *max;                /* Region end */
+    void *remote;             /* Blocks freed by other threads, atomic */
+    void *tcache[TCACHE_CLASSES];
+    int tcount[TCACHE_CLASSES];
+} arena_t;
+
+/* The link of a block on a tcache or remote-free list, in its payload */
+#define NEXT_FREE(ptr) (*(void **)(ptr))
+
+/* The arena a block belongs to */
+#define ARENA_OF(ptr) ((arena_t *)((uintptr_t)(ptr) & ~((uintptr_t)ARENA_SIZE - 1)))
+
+static arena_t *arenas = NULL;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static unsigned long narenas, nremote;
+
+/* The calling thread's arena; the heap mm.c works on */
+static __thread arena_t *cur = NULL;
+
+/* release - a thread exits; leave its arena for another to adopt */
+static void release(void *vargp)
+{
+    arena_t *a = vargp;
+
+    __atomic_store_n(&a->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void make_key(void)
+{
+    pthread_key_create(&arena_key, release);
+}
+
+/* new_arena - map a region of ARENA_SIZE aligned to its size */
+static arena_t *new_arena(void)
+{
+    char *p, *base;
+    arena_t *a;
+
+    p = mmap(NULL, 2 * (size_t)ARENA_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    base = (char *)(((uintptr_t)p + ARENA_SIZE - 1) & ~((uintptr_t)ARENA_SIZE - 1));
+    if (base > p)
+        munmap(p, base - p);
+    munmap(base + ARENA_SIZE, p + ARENA_SIZE - base);
+
+    a = (arena_t *)base;
+    memset(a, 0, sizeof(arena_t));
+    a->lo = a->brk = base + ((sizeof(arena_t) + 63) & ~63);
+    a->max = base + ARENA_SIZE;
+    return a;
+}
+
+/* attach - give the calling thread an arena, adopting a released one if possible */
+static arena_t *attach(void)
+{
+    arena_t *a;
+
+    pthread_once(&arena_once, make_key);
+    pthread_mutex_lock(&arenas_lock);
+    for (a = arenas; a != NULL; a = a->next)
+        if (!__atomic_load_n(&a->owned, __ATOMIC_ACQUIRE))
+            break;
+    if (a == NULL && (a = new_arena()) != NULL) {
+        a->next = arenas;
+        __atomic_store_n(&arenas, a, __ATOMIC_RELEASE);
+        narenas++;
+    }
+    if (a != NULL)
+        a->owned = 1;
+    pthread_mutex_unlock(&arenas_lock);
+    if (a == NULL)
+        return NULL;
+
+    cur = a;
+    pthread_setspecific(arena_key, a);
+    if (!a->initialized) {
+        if (mm_init() < 0)
+            return NULL;
+        a->initialized = 1;
+    }
+    return a;
+}
+
+/* is_arena - does a name an arena; arenas are never unmapped, so the list is read without the lock */
+static int is_arena(arena_t *a)
+{
+    arena_t *p;
+
+    for (p = __atomic_load_n(&arenas, __ATOMIC_ACQUIRE); p != NULL; p = p->next)
+        if (p == a)
+            return 1;
+    return 0;
+}
+
+/* drain - free the blocks other threads have handed back to a */
+static void drain(arena_t *a)
+{
+    void *ptr, *next;
+
+    ptr = __atomic_exchange_n(&a->remote, NULL, __ATOMIC_ACQUIRE);
+    for (; ptr != NULL; ptr = next) {
+        next = NEXT_FREE(ptr);
+        mm_free(ptr);
+    }
+}
+
+/* own - the calling thread's arena, ready to use, or NULL */
+static arena_t *own(void)
+{
+    arena_t *a = cur;
+
+    if (a == NULL && (a = attach()) == NULL)
+        return NULL;
+    if (__atomic_load_n(&a->remote, __ATOMIC_RELAXED) != NULL)
+        drain(a);
+    return a;
+}
+
+/*
+ * mt_malloc - allocate size bytes from the calling thread's arena
+ */
+void *mt_malloc(size_t size)
+{
+    arena_t *a;
+    void *ptr;
+    size_t c;
+
+    if (size == 0 || (a = own()) == NULL)
+        return NULL;
+
+    /* Every block in class c holds at least TCACHE_MIN + 16c bytes */
+    c = (size <= TCACHE_MIN) ? 0 : (size - TCACHE_MIN + 15) / 16;
+    if (c < TCACHE_CLASSES && (ptr = a->tcache[c]) != NULL) {
+        a->tcache[c] = NEXT_FREE(ptr);
+        a->tcount[c]--;
+        return ptr;
+    }
+    return mm_malloc(size);
+}
+
+/*
+ * mt_free - free a block allocated by any thread
+ */
+void mt_free(void *ptr)
+{
+    arena_t *owner, *a;
+    size_t c, usable;
+
+    if (ptr == NULL)
+        return;
+    owner = ARENA_OF(ptr);
+    if (owner != cur && !is_arena(owner)) {
+        /* Mapped on its own; mm_free unmaps it */
+        if (own() != NULL)
+            mm_free(ptr);
+        return;
+    }
+    if (owner != cur) {
+        /* Push it on the owner's remote-free list */
+        NEXT_FREE(ptr) = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&owner->remote, &NEXT_FREE(ptr), ptr, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+        __atomic_fetch_add(&nremote, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    a = own();
+    usable = mm_usable_size(ptr);
+    if (usable >= TCACHE_MIN) {
+        c = (usable - TCACHE_MIN) / 16;
+        if (c < TCACHE_CLASSES && a->tcount[c] < TCACHE_COUNT) {
+            NEXT_FREE(ptr) = a->tcache[c];
+            a->tcache[c] = ptr;
+            a->tcount[c]++;
+            return;
+        }
+    }
+    mm_free(ptr);
+}
+
+/*
+ * mt_realloc - resize a block allocated by any thread. A block from
+ *     another thread's arena is moved to the caller's; one mapped on
+ *     its own is resized where it is.
+ */
+void *mt_realloc(void *ptr, size_t size)
+{
+    arena_t *owner, *a;
+    void *newptr;
+    size_t usable;
+
+    if (ptr == NULL)
+        return mt_malloc(size);
+    if (size == 0) {
+        mt_free(ptr);
+        return NULL;
+    }
+    owner = ARENA_OF(ptr);
+    if ((owner == cur || !is_arena(owner)) && own() != NULL)
+        return mm_realloc(ptr, size);
+
+    if ((newptr = mt_malloc(size)) == NULL)
+        return NULL;
+    /* The size of a live block stays put, so it can be read in its owner's heap */
+    a = cur;
+    cur = owner;
+    usable = mm_usable_size(ptr);
+    cur = a;
+    memcpy(newptr, ptr, usable < size ? usable : size);
+    mt_free(ptr);
+    return newptr;
+}
+
+/*
+ * mt_counts - the number of arenas mapped and of blocks freed by a
+ *     thread other than their owner
+ */
+void mt_counts(unsigned long *na, unsigned long *nr)
+{
+    pthread_mutex_lock(&arenas_lock);
+    *na = narenas;
+    pthread_mutex_unlock(&arenas_lock);
+    *nr = __atomic_load_n(&nremote, __ATOMIC_RELAXED);
+}
+
+/*
+ * The memlib interface mm.c uses, on the calling thread's arena
+ */
+void *mem_sbrk(int incr)
+{
+    char *old_brk = cur->brk;
+    uintptr_t page = getpagesize();
+    char *start;
+
+    if ((incr < 0 && -incr > cur->brk - cur->lo) ||
+        (incr > 0 && incr > cur->max - cur->brk)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+    cur->brk += incr;
+    if (incr < 0) {
+        /* Release the pages wholly above the new end */
+        start = (char *)(((uintptr_t)cur->brk + page - 1) & ~(page - 1));
+        if (start < old_brk)
+            madvise(start, old_brk - start, MADV_DONTNEED);
+    }
+    return (void *)old_brk;
+}
+
+void mem_discard(void *ptr, size_t len)
+{
+    madvise(ptr, len, MADV_DONTNEED);
+}
+
+void *mem_map(size_t len)
+{
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    return (p == MAP_FAILED) ? (void *)-1 : p;
+}
+
+void mem_unmap(void *ptr, size_t len)
+{
+    munmap(ptr, len);
+}
+
+void *mem_remap(void *ptr, size_t old_len, size_t new_len)
+{
+    void *p = mremap(ptr, old_len, new_len, MREMAP_MAYMOVE);
+
+    return (p == MAP_FAILED) ? (void *)-1 : p;
+}
+
+void *mem_heap_lo(void)
+{
+    return (void *)cur->lo;
+}
+
+void *mem_heap_hi(void)
+{
+    return (void *)(cur->brk - 1);
+}
+
+size_t mem_heapsize(void)
+{
+    return (size_t)(cur->brk - cur->lo);
+}
+
+size_t mem_pagesize(void)
+{
+    return (size_t)getpagesize();
+}
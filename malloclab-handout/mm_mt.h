@@ -0,0 +1,20 @@
+/*
+ * mm_mt.h - thread-safe allocator with one mm.c heap per thread
+ */
+#ifndef __MM_MT_H__
+#define __MM_MT_H__
+
+#include <stddef.h>
+
+#define ARENA_SIZE     (64 << 20) /* Address space of one arena, aligned to it */
+#define TCACHE_CLASSES 32         /* Sizes a thread caches freed blocks of */
+#define TCACHE_MIN     12         /* Payload of the smallest cached class */
+#define TCACHE_COUNT   32         /* Blocks cached per class */
+
+void *mt_malloc(size_t size);
+void mt_free(void *ptr);
+void *mt_realloc(void *ptr, size_t size);
+
+void mt_counts(unsigned long *narenas, unsigned long *nremote);
+
+#endif
@@ -0,0 +1,144 @@
+/*
+ * mtbench.c - multi-threaded benchmark of mm_mt.c against libc malloc
+ *
+ * usage: mtbench [threads] [ops per thread] [max size]
+ *
+ * Each thread allocates blocks of random sizes (mostly small, some up
+ * to max size), fills them and frees them again later. Three of four
+ * blocks go to a slot private to the thread; the fourth is swapped into
+ * a slot shared by all threads, so the block it displaces, and which
+ * it frees, was usually allocated by another thread. Every block is
+ * checked before it is freed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "mm_mt.h"
+
+#define NLOCAL  1024          /* Live blocks per thread */
+#define NSHARED 4096          /* Live blocks shared by all threads */
+
+typedef struct {
+    char *name;
+    void *(*malloc)(size_t);
+    void (*free)(void *);
+} allocator_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t tag;
+} blk_t;
+
+static allocator_t *alloc;
+static blk_t *shared[NSHARED];
+static long nops;
+static size_t max_size;
+static long nbad;
+
+/* xorshift, one state per thread */
+static uint32_t rnd(uint32_t *s)
+{
+    *s ^= *s << 13;
+    *s ^= *s >> 17;
+    *s ^= *s << 5;
+    return *s;
+}
+
+static blk_t *get(uint32_t *s)
+{
+    uint32_t r = rnd(s);
+    size_t size = (r % 8) ? 8 + r % 120 : 8 + r % max_size;
+    blk_t *b = alloc->malloc(size);
+
+    if (b == NULL) {
+        fprintf(stderr, "%s: out of memory\n", alloc->name);
+        exit(1);
+    }
+    b->size = size;
+    b->tag = r;
+    memset(b + 1, (char)r, size - sizeof(blk_t));
+    return b;
+}
+
+static void put(blk_t *b)
+{
+    if (b == NULL)
+        return;
+    if (b->size > sizeof(blk_t) && ((char *)b)[b->size - 1] != (char)b->tag)
+        __atomic_fetch_add(&nbad, 1, __ATOMIC_RELAXED);
+    alloc->free(b);
+}
+
+static void *thread(void *vargp)
+{
+    blk_t *local[NLOCAL] = { NULL };
+    uint32_t s = (uint32_t)(long)vargp * 2654435761u + 1;
+    long i;
+    int j;
+
+    for (i = 0; i < nops; i++) {
+        blk_t *b = get(&s);
+        uint32_t r = rnd(&s);
+
+        if (r % 4 == 0)
+            put(__atomic_exchange_n(&shared[r / 4 % NSHARED], b, __ATOMIC_ACQ_REL));
+        else {
+            put(local[r % NLOCAL]);
+            local[r % NLOCAL] = b;
+        }
+    }
+    for (j = 0; j < NLOCAL; j++)
+        put(local[j]);
+    return NULL;
+}
+
+static void run(allocator_t *a, int nthreads)
+{
+    pthread_t tid[nthreads];
+    struct timespec t0, t1;
+    double secs;
+    long i;
+
+    alloc = a;
+    nbad = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&tid[i], NULL, thread, (void *)i);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(tid[i], NULL);
+    for (i = 0; i < NSHARED; i++) {
+        put(shared[i]);
+        shared[i] = NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    printf("%-8s %8.2f Mops/s  %s\n", a->name,
+           2.0 * nops * nthreads / secs / 1e6, nbad ? "CORRUPTED" : "ok");
+}
+
+int main(int argc, char **argv)
+{
+    int nthreads = argc > 1 ? atoi(argv[1]) : 4;
+    allocator_t mt = { "mm_mt", mt_malloc, mt_free };
+    allocator_t libc = { "libc", malloc, free };
+    unsigned long narenas, nremote;
+
+    nops = argc > 2 ? atol(argv[2]) : 1000000;
+    max_size = argc > 3 ? atol(argv[3]) : 4096;
+    if (nthreads < 1 || nops < 1 || max_size < sizeof(blk_t)) {
+        fprintf(stderr, "usage: %s [threads] [ops per thread] [max size]\n", argv[0]);
+        exit(1);
+    }
+    printf("%d threads, %ld ops each, sizes up to %lu\n",
+           nthreads, nops, (unsigned long)max_size);
+    run(&mt, nthreads);
+    run(&libc, nthreads);
+    mt_counts(&narenas, &nremote);
+    printf("mm_mt: %lu arenas, %lu remote frees\n", narenas, nremote);
+    exit(0);
+}
@@ -0,0 +1,189 @@
+/*
+ * admit.c - per-client rate limiting and admission control
+ *
+ * Every accepted connection must pass three checks before it is queued
+ * for a worker, and is answered with 503 at once if it fails one:
+ *
+ *   - its source address has a token in its bucket. Buckets refill at
+ *     a steady rate up to a burst depth, so a client can open rate
+ *     connections per second on average;
+ *   - the address has fewer than client_max connections in flight
+ *     (queued or being served);
+ *   - fewer than total_max connections are in flight overall.
+ *
+ * The per-client cap keeps the shared queue fair: however hard one
+ * client pushes, it holds at most client_max of the total_max places,
+ * and the rest stay open to everyone else in arrival order.
+ *
+ * Client state lives in a fixed table split into ADMIT_SHARDS shards
+ * picked by a hash of the address. Each shard has its own lock and an
+ * open-addressed array of ADMIT_SLOTS clients, so threads only contend
+ * when they touch the same shard, and the global in-flight count is a
+ * single atomic counter. A client with nothing in flight may be evicted
+ * (least recently seen first) to make room for a new one, which costs
+ * it nothing more than a fresh, full bucket.
+ *
+ * A connection that is admitted gets a ticket naming its client's slot,
+ * which the worker hands back to admit_release when it is done.
+ */
+#include <time.h>
+#include "admit.h"
+
+typedef struct {
+    int used;
+    unsigned char addr[16];   /* IPv4 addresses are stored v4-mapped */
+    double tokens;
+    long long last;           /* Last refill, in ms */
+    int inflight;
+} admit_client_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    admit_client_t clients[ADMIT_SLOTS];
+} __attribute__((aligned(64))) admit_shard_t;
+
+static admit_shard_t shards[ADMIT_SHARDS];
+static double rate, burst;
+static int client_max, total_max;
+static int total;             /* Connections in flight, atomic */
+static unsigned long admitted, rejected;
+
+/* now_ms - monotonic clock in milliseconds */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* addr_key - the 16-byte key of addr's host, and its FNV-1a hash */
+static unsigned addr_key(struct sockaddr *addr, unsigned char *key)
+{
+    unsigned h = 2166136261u;
+    int i;
+
+    memset(key, 0, 16);
+    if (addr->sa_family == AF_INET6) {
+        memcpy(key, &((struct sockaddr_in6 *)addr)->sin6_addr, 16);
+    } else if (addr->sa_family == AF_INET) {
+        key[10] = key[11] = 0xff;
+        memcpy(key + 12, &((struct sockaddr_in *)addr)->sin_addr, 4);
+    }
+    for (i = 0; i < 16; i++)
+        h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+/*
+ * admit_init - allow each client rate connections per second with
+ *     bursts of up to burst, client_max of them in flight at a time,
+ *     and total_max in flight overall
+ */
+void admit_init(double r, double b, int cmax, int tmax)
+{
+    int i;
+
+    rate = r;
+    burst = b;
+    client_max = cmax;
+    total_max = tmax;
+    for (i = 0; i < ADMIT_SHARDS; i++)
+        pthread_mutex_init(&shards[i].lock, NULL);
+}
+
+/*
+ * admit_acquire - decide whether to serve a connection from addr.
+ *     Returns a ticket (>= 0) for admit_release, or one of the
+ *     negative ADMIT_ reasons if the connection should be refused.
+ */
+int admit_acquire(struct sockaddr *addr)
+{
+    unsigned char key[16];
+    unsigned h = addr_key(addr, key);
+    admit_shard_t *sh = &shards[h % ADMIT_SHARDS];
+    admit_client_t *cl, *victim = NULL;
+    long long now = now_ms();
+    int i, slot, rc;
+
+    pthread_mutex_lock(&sh->lock);
+
+    /* Find the client, or the best slot to start tracking it in */
+    for (i = 0; i < ADMIT_SLOTS; i++) {
+        slot = (h / ADMIT_SHARDS + i) % ADMIT_SLOTS;
+        cl = &sh->clients[slot];
+        if (!cl->used || memcmp(cl->addr, key, 16) == 0)
+            break;
+        if (cl->inflight == 0 && (victim == NULL || cl->last < victim->last))
+            victim = cl;
+    }
+    if (i == ADMIT_SLOTS) {
+        if ((cl = victim) == NULL) {
+            rc = ADMIT_OVERLOADED;          /* Every slot is busy */
+            goto out;
+        }
+        slot = cl - sh->clients;
+        cl->used = 0;
+    }
+    if (!cl->used) {
+        cl->used = 1;
+        memcpy(cl->addr, key, 16);
+        cl->tokens = burst;
+        cl->last = now;
+        cl->inflight = 0;
+    }
+
+    /* Refill the bucket for the time since the last connection */
+    cl->tokens += (now - cl->last) * rate / 1000.0;
+    if (cl->tokens > burst)
+        cl->tokens = burst;
+    cl->last = now;
+
+    if (cl->tokens < 1.0)
+        rc = ADMIT_RATE_LIMITED;
+    else if (cl->inflight >= client_max)
+        rc = ADMIT_CLIENT_BUSY;
+    else if (__atomic_add_fetch(&total, 1, __ATOMIC_RELAXED) > total_max) {
+        __atomic_sub_fetch(&total, 1, __ATOMIC_RELAXED);
+        rc = ADMIT_OVERLOADED;
+    }
+    else {
+        cl->tokens -= 1.0;
+        cl->inflight++;
+        rc = (sh - shards) * ADMIT_SLOTS + slot;
+    }
+
+ out:
+    pthread_mutex_unlock(&sh->lock);
+    __atomic_fetch_add(rc >= 0 ? &admitted : &rejected, 1, __ATOMIC_RELAXED);
+    return rc;
+}
+
+/* admit_release - a connection admitted with ticket is finished */
+void admit_release(int ticket)
+{
+    admit_shard_t *sh = &shards[ticket / ADMIT_SLOTS];
+
+    pthread_mutex_lock(&sh->lock);
+    sh->clients[ticket % ADMIT_SLOTS].inflight--;
+    pthread_mutex_unlock(&sh->lock);
+    __atomic_sub_fetch(&total, 1, __ATOMIC_RELAXED);
+}
+
+/* admit_strerror - describe an ADMIT_ reason */
+char *admit_strerror(int rc)
+{
+    switch (rc) {
+    case ADMIT_RATE_LIMITED: return "rate limited";
+    case ADMIT_CLIENT_BUSY:  return "too many connections from client";
+    case ADMIT_OVERLOADED:   return "proxy overloaded";
+    default:                 return "admitted";
+    }
+}
+
+/* admit_counts - connections admitted and refused so far */
+void admit_counts(unsigned long *a, unsigned long *r)
+{
+    *a = __atomic_load_n(&admitted, __ATOMIC_RELAXED);
+    *r = __atomic_load_n(&rejected, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,30 @@
+/*
+ * admit.h - per-client rate limiting and admission control
+ */
+#ifndef __ADMIT_H__
+#define __ADMIT_H__
+
+#include "csapp.h"
+
+#define ADMIT_SHARDS     64   /* Independently locked parts of the table */
+#define ADMIT_SLOTS      64   /* Clients tracked per shard */
+#define ADMIT_RATE       50   /* Default connections per second per client */
+#define ADMIT_BURST      100  /* Default bucket depth */
+#define ADMIT_CLIENT_MAX 16   /* Default connections in flight per client */
+
+/* Why admit_acquire turned a connection away */
+#define ADMIT_RATE_LIMITED -1 /* The client's bucket is empty */
+#define ADMIT_CLIENT_BUSY  -2 /* The client has its share in flight */
+#define ADMIT_OVERLOADED   -3 /* The proxy as a whole is at its cap */
+
+void admit_init(double rate, double burst, int client_max, int total_max);
+
+int admit_acquire(struct sockaddr *addr);
+
+void admit_release(int ticket);
+
+char *admit_strerror(int rc);
+
+void admit_counts(unsigned long *admitted, unsigned long *rejected);
+
+#endif
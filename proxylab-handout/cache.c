@@ -2,8 +2,6 @@
 
 static void free_cell(Cell *ptr, Cache *cache);
 
-static void print_cache(Cache *cache);
-
 void cache_init(Cache *cache) {
     cache->head = NULL;
     cache->size = 0;
@@ -29,14 +27,12 @@ ssize_t read_cache(Cache *cache, char *url, char *buf, size_t n) {
     }
     if (ptr != NULL) {
         cpy_sz = (n >= ptr->size ? ptr->size: n);
-        strncpy(buf, ptr->object, cpy_sz);
+        memcpy(buf, ptr->object, cpy_sz);
         ptr->t = time(NULL);
     }
 
     P(&cache->rd_mutex);
     cache->rthread_n--;
-    printf("%s\ncache: ", "try to read cache");
-    print_cache(cache);
     if (cache->rthread_n == 0)
         V(&cache->rw_lock);
     V(&cache->rd_mutex);
@@ -78,7 +74,7 @@ ssize_t write_cache(Cache *cache, char *url, char *buf, size_t n) {
     ptr->object = (char *) malloc(n);
     ptr->size = n;
     cache->size += n;
-    strncpy(ptr->object, buf, n);
+    memcpy(ptr->object, buf, n);
     ptr->t = time(NULL);
     ptr->prev = NULL;
     if (cache->head != NULL)
@@ -86,8 +82,6 @@ ssize_t write_cache(Cache *cache, char *url, char *buf, size_t n) {
     ptr->next = cache->head;
     cache->head = ptr;
 
-    printf("%s\ncache: ", "Try to write cache");
-    print_cache(cache);
     V(&cache->rw_lock);
     
     return n;
@@ -106,12 +100,3 @@ static void free_cell(Cell *ptr, Cache *cache) {
         ptr->next->prev = ptr->prev;
     free(ptr);
 }
-
-static void print_cache(Cache *cache) {
-    Cell *ptr = cache->head;
-    while (ptr != NULL) {
-        printf("%s:[size: %d bytes, t: %ld]->", ptr->url, ptr->size, ptr->t);
-        ptr = ptr->next;
-    }
-    printf("%c", '\n');
-}
@@ -0,0 +1,154 @@
+/*
+ * mpmcbench.c - compare the csapp MPMC queue with a semaphore sbuf
+ *
+ * usage: mpmcbench [producers] [consumers] [items] [slots]
+ *
+ * Each run has the producers push items (all in all) through one
+ * queue of the given size to the consumers, and reports the rate.
+ * The queue is run with the default spin count and with spinning
+ * turned off, next to the textbook sbuf (a mutex semaphore plus
+ * slot and item counting semaphores).
+ */
+#include "csapp.h"
+
+/* The sbuf package of CS:APP section 12.5.4 */
+typedef struct {
+    void **buf;
+    int n;
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} sbuf_t;
+
+static void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(void *));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+static void sbuf_insert(sbuf_t *sp, void *item)
+{
+    P(&sp->slots);
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    V(&sp->mutex);
+    V(&sp->items);
+}
+
+static void *sbuf_remove(sbuf_t *sp)
+{
+    void *item;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/* One benchmark run */
+typedef struct {
+    int use_sbuf;
+    mpmc_t q;
+    sbuf_t sb;
+    long per_producer;
+    long per_consumer;
+    long sum;                  /* Checks that every item came out once */
+} bench_t;
+
+static void *producer(void *vargp)
+{
+    bench_t *b = vargp;
+    long i;
+
+    for (i = 1; i <= b->per_producer; i++) {
+	if (b->use_sbuf)
+	    sbuf_insert(&b->sb, (void *)i);
+	else
+	    mpmc_put(&b->q, (void *)i);
+    }
+    return NULL;
+}
+
+static void *consumer(void *vargp)
+{
+    bench_t *b = vargp;
+    long i, sum = 0;
+
+    for (i = 0; i < b->per_consumer; i++) {
+	if (b->use_sbuf)
+	    sum += (long)sbuf_remove(&b->sb);
+	else
+	    sum += (long)mpmc_get(&b->q);
+    }
+    __atomic_fetch_add(&b->sum, sum, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+static void run(char *name, int use_sbuf, int spins, int np, int nc,
+		long items, int slots)
+{
+    bench_t b;
+    pthread_t tid[np + nc];
+    struct timespec t0, t1;
+    double secs;
+    long expect;
+    int i;
+
+    b.use_sbuf = use_sbuf;
+    if (use_sbuf)
+	sbuf_init(&b.sb, slots);
+    else if (mpmc_init(&b.q, slots, spins) < 0)
+	unix_error("mpmc_init error");
+    b.per_producer = items / np;
+    b.per_consumer = b.per_producer * np / nc;
+    b.sum = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < nc; i++)
+	Pthread_create(&tid[np + i], NULL, consumer, &b);
+    for (i = 0; i < np; i++)
+	Pthread_create(&tid[i], NULL, producer, &b);
+    for (i = 0; i < np + nc; i++)
+	Pthread_join(tid[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    expect = np * (b.per_producer * (b.per_producer + 1) / 2);
+    printf("%-16s %8.2f Mitems/s  %s\n", name,
+	   b.per_consumer * nc / secs / 1e6,
+	   b.sum == expect ? "ok" : "LOST ITEMS");
+    if (use_sbuf)
+	Free(b.sb.buf);
+    else
+	mpmc_deinit(&b.q);
+}
+
+int main(int argc, char **argv)
+{
+    int np = argc > 1 ? atoi(argv[1]) : 4;
+    int nc = argc > 2 ? atoi(argv[2]) : 4;
+    long items = argc > 3 ? atol(argv[3]) : 2000000;
+    int slots = argc > 4 ? atoi(argv[4]) : 1024;
+
+    if (np < 1 || nc < 1 || items < np || slots < 2 || (slots & (slots - 1)) ||
+	(items / np) * np % nc != 0) {
+	fprintf(stderr, "usage: %s [producers] [consumers] [items] [slots]\n"
+		"  slots a power of two; producers*(items/producers) "
+		"divisible by consumers\n", argv[0]);
+	exit(1);
+    }
+    printf("%d producers, %d consumers, %ld items, %d slots\n",
+	   np, nc, items, slots);
+    run("mpmc (spin)", 0, MPMC_SPINS, np, nc, items, slots);
+    run("mpmc (no spin)", 0, 0, np, nc, items, slots);
+    run("sbuf (sem)", 1, 0, np, nc, items, slots);
+    exit(0);
+}
@@ -3,8 +3,21 @@
 #include <time.h>
 #include "csapp.h"
 #include "cache.h"
+#include "accesslog.h"
+#include "tunnel.h"
+#include "admit.h"
 
 
+#define NTHREADS 32   /* Worker threads, created at startup */
+#define QUEUESIZE 256 /* Accepted connections waiting for a worker */
+#define MAXINFLIGHT (NTHREADS + QUEUESIZE) /* Beyond this, fail fast with 503 */
+
+/* Timeouts, in milliseconds, that keep a stalled peer from pinning a thread */
+#define CONNECT_TIMEOUT 5000   /* Connecting to the origin server */
+#define IO_TIMEOUT      10000  /* Any single read or write */
+#define REQUEST_TIMEOUT 30000  /* Reading a whole request, or response from the origin */
+#define TUNNEL_TIMEOUT  120000 /* A CONNECT tunnel with no traffic either way */
+
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 
@@ -12,11 +25,24 @@ static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64;
 /* proxy cache */
 static Cache cache;
 
-void *serve_client(void *connfd);
+/* Connected descriptors, from the main thread to the workers */
+static mpmc_t connq;
+
+void *worker(void *vargp);
+
+void serve_client(int fd);
+
+void refuse(int fd, char *client, int reason);
 
 int parse_request(rio_t *rp, char *req_buf, char *host, char *port, char *url);
 
-int proxy_request(int connfd, char *req_buf, char *host, char *port, char *url);
+int proxy_request(int connfd, char *req_buf, char *host, char *port, char *url, int *status, long *bytes);
+
+int parse_connect(rio_t *rp, char *authority, char *host, char *port);
+
+int tunnel(rio_t *rp, char *host, char *port, int *status, long *bytes);
+
+void peer_name(int fd, char *name, size_t len);
 
 void debug_respond(int fd, char *msg);
 
@@ -24,64 +50,172 @@ void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longms
 
 int main(int argc, char *argv[])
 {   
-    if (argc != 2) {
-        printf("Usage: ./proxy <port number>\n");
+    if (argc != 2 && argc != 3) {
+        printf("Usage: ./proxy <port number> [access log]\n");
         exit(0);    
     }
 
-    int listenfd, connfd;
+    int listenfd, connfd, i, ticket;
     struct sockaddr_storage clientaddr;
     socklen_t clientaddr_len = sizeof(struct sockaddr_storage);
     char hostname[MAXLINE], port[MAXLINE];
     pthread_t tid;
 
+    if (alog_init(argc == 3 ? argv[2] : NULL, ALOG_FLUSH_MS, ALOG_ROTATE_SIZE) < 0)
+        unix_error("Access log open error");
+
     listenfd = Open_listenfd(argv[1]);
+    Signal(SIGPIPE, SIG_IGN);  /* A client going away fails one write */
 
     /* init clock_mutex */
     cache_init(&cache);
+
+    admit_init(ADMIT_RATE, ADMIT_BURST, ADMIT_CLIENT_MAX, MAXINFLIGHT);
+
+    /* Prethread the workers; they take connections off connq */
+    if (mpmc_init(&connq, QUEUESIZE, MPMC_SPINS) < 0)
+        unix_error("mpmc_init error");
+    for (i = 0; i < NTHREADS; i++)
+        Pthread_create(&tid, NULL, worker, NULL);
     
     while (1) {
-        if ((connfd = Accept(listenfd, (SA *) &clientaddr, &clientaddr_len)) == -1)
+        clientaddr_len = sizeof(struct sockaddr_storage);
+        if ((connfd = accept(listenfd, (SA *) &clientaddr, &clientaddr_len)) == -1)
             continue;
+        /* Numeric only: a reverse lookup here would stall every accept */
         Getnameinfo((SA *) &clientaddr, clientaddr_len, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, serve_client, (void *)connfd);
-        printf("sprawn thread: %lu\n", tid);
+                    port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+        if ((ticket = admit_acquire((SA *) &clientaddr)) < 0) {
+            refuse(connfd, hostname, ticket);
+            continue;
+        }
+        alog_printf("Accepted connection from (%s, %s)", hostname, port);
+        /* Admission keeps at most MAXINFLIGHT queued, so this never waits */
+        mpmc_put(&connq, (void *)((long)ticket << 32 | connfd));
     }
 
     // printf("%s", user_agent_hdr);
     return 0;
 }
 
-void *serve_client(void *connfd) {
+/* worker - serve connections from connq, one at a time, forever */
+void *worker(void *vargp) {
+    long item;
+
     Pthread_detach(Pthread_self());
-    int fd = (int)connfd;
+    while (1) {
+        item = (long)mpmc_get(&connq);
+        serve_client((int)(item & 0xffffffff));
+        admit_release((int)(item >> 32));
+    }
+    return NULL;
+}
+
+/*
+ * refuse - turn away a connection that admission control rejected,
+ *     without ever blocking the accept loop on it: a canned 503 is
+ *     sent only if the socket takes it at once, and whatever request
+ *     bytes have arrived are drained so the close doesn't reset the
+ *     connection before the client reads the answer
+ */
+void refuse(int fd, char *client, int reason) {
+    static char msg[] = "HTTP/1.0 503 Service Unavailable\r\n"
+        "Retry-After: 1\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+    char buf[MAXLINE];
+    unsigned long nadmitted, nrefused;
+
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+        ;
+    send(fd, msg, strlen(msg), MSG_DONTWAIT);
+    close(fd);
+    admit_counts(&nadmitted, &nrefused);
+    alog_printf("Refused connection from %s: %s (%lu refused, %lu admitted so far)",
+                client, admit_strerror(reason), nrefused, nadmitted);
+    alog_access(client, "-", 503, 0);
+}
+
+void serve_client(int fd) {
     rio_t rp;
     char req[MAXLINE];
     char host[MAXLINE], port[10], url[MAXLINE];
+    char client[NI_MAXHOST + NI_MAXSERV + 1], reqline[MAXLINE + 4];
+    int status = 0, rc, timedout = 0, connect = 0;
+    long bytes = 0;
+    unsigned long nconnect, nread, nwrite;
 
     Rio_readinitb(&rp, fd);
+    rio_settimeout(&rp, IO_TIMEOUT, IO_TIMEOUT);
+    rio_setdeadline(&rp, REQUEST_TIMEOUT); /* Not one header byte at a time forever */
+    peer_name(fd, client, sizeof(client));
+    url[0] = '\0';
     
-    if (parse_request(&rp, req, host, port, url) != 0)
-        clienterror(rp.rio_fd, "parse request failed", "400", "Bad Request", "Bad request");
-    
-    printf("%s", req);
-    if (proxy_request(fd, req, host, port, url) != 0)
-        clienterror(rp.rio_fd, "proxy request failed", "400", "Bad Request", "Bad request");
+    rc = parse_request(&rp, req, host, port, url);
+    connect = (rc == 1);
+    if (rc < 0) {
+        timedout = (errno == ETIMEDOUT);
+        if (!timedout) {
+            clienterror(rp.rio_fd, "parse request failed", "400", "Bad Request", "Bad request");
+            status = 400;
+        }
+    } else if ((rc = connect ? tunnel(&rp, host, port, &status, &bytes) :
+                proxy_request(fd, req, host, port, url, &status, &bytes)) != 0) {
+        timedout = (errno == ETIMEDOUT);
+        if (rc == -1 && timedout) {
+            clienterror(rp.rio_fd, url, "504", "Gateway Timeout", "The server didn't respond in time");
+            status = 504;
+        } else if (rc == -1) {
+            clienterror(rp.rio_fd, url, "502", "Bad Gateway", "Couldn't get a response from the server");
+            status = 502;
+        }
+    }
+    if (timedout) {
+        timeout_counts(&nconnect, &nread, &nwrite);
+        alog_printf("Timed out serving %s (timeouts so far: %lu connect, %lu read, %lu write)",
+                    client, nconnect, nread, nwrite);
+    }
     
+    snprintf(reqline, sizeof(reqline), "%s %s", connect ? "CONNECT" : "GET", url);
+    alog_access(client, reqline, status, bytes);
     close(fd);
 }
 
+/* peer_name - format the numeric "host:port" of the peer of fd */
+void peer_name(int fd, char *name, size_t len) {
+    struct sockaddr_storage addr;
+    socklen_t addrlen = sizeof(addr);
+    char host[NI_MAXHOST], serv[NI_MAXSERV];
+
+    if (getpeername(fd, (SA *) &addr, &addrlen) < 0 ||
+        getnameinfo((SA *) &addr, addrlen, host, sizeof(host), serv, sizeof(serv),
+                    NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+        snprintf(name, len, "-");
+        return;
+    }
+    snprintf(name, len, "%s:%s", host, serv);
+}
+
+/*
+ * parse_request - read the client's request. A GET is rewritten into
+ *     req_buf for the origin and 0 is returned. A CONNECT host:port
+ *     leaves req_buf empty and returns 1. Returns -1 on a bad request
+ *     or read error.
+ */
 int parse_request(rio_t *rp, char *req_buf, char *host, char *port, char *full_url) {
     char buf[MAXLINE], url[MAXLINE];
     char method[16], version[32];
     int find_host = 0;
     int add_host = 1;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    sscanf(buf, "%s %s %s", method, url, version);
+    errno = 0;
+    req_buf[0] = '\0';
+    port[0] = '\0';
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+        return -1;
+    if (sscanf(buf, "%15s %s %31s", method, url, version) != 3)
+        return -1;
     strcpy(full_url, url);
+    if (strcmp(method, "CONNECT") == 0)
+        return parse_connect(rp, url, host, port);
     if (strcmp(method, "GET") != 0) 
         return -1;
     
@@ -120,7 +254,8 @@ int parse_request(rio_t *rp, char *req_buf, char *host, char *port, char *full_u
     sprintf(req_buf, "%s %s %s\r\n", method, url, "HTTP/1.0");
 
     do {
-        Rio_readlineb(rp, buf, MAXLINE);
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+            return -1;
         if (strstr(buf, "Host:") != NULL) 
             add_host = 0;
         if ((strstr(buf, "Connection:") != NULL) || (strstr(buf, "Proxy-Connection") != NULL))
@@ -143,77 +278,165 @@ int parse_request(rio_t *rp, char *req_buf, char *host, char *port, char *full_u
     return 0;
 }
 
-int proxy_request(int connfd, char *req_buf, char *host, char *port, char *url) {
+/*
+ * parse_connect - split the host:port (or [v6addr]:port) target of a
+ *     CONNECT and skip its headers. Returns 1, or -1 if it is malformed.
+ */
+int parse_connect(rio_t *rp, char *authority, char *host, char *port) {
+    char buf[MAXLINE], *colon;
+
+    if ((colon = strrchr(authority, ':')) == NULL || colon[1] == '\0' ||
+        strlen(colon + 1) > 5 || strspn(colon + 1, "0123456789") != strlen(colon + 1))
+        return -1;
+    strcpy(port, colon + 1);
+    *colon = '\0';
+    if (authority[0] == '[' && colon[-1] == ']') {  /* IPv6 literal */
+        colon[-1] = '\0';
+        authority++;
+    }
+    strcpy(host, authority);
+    *colon = ':';
+    do {
+        if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+            return -1;
+    } while (strcmp(buf, "\r\n") && strcmp(buf, "\n"));
+    return 1;
+}
+
+/*
+ * tunnel - serve a CONNECT: connect to host:port, tell the client, and
+ *     relay bytes both ways without looking at them (see tunnel.c).
+ *     *bytes counts bytes sent to the client. Returns like
+ *     proxy_request.
+ */
+int tunnel(rio_t *rp, char *host, char *port, int *status, long *bytes) {
+    static char established[] = "HTTP/1.1 200 Connection Established\r\n\r\n";
+    int serverfd, rc;
+    long up = 0, down = 0;
+    char *data;
+    ssize_t n;
+
+    if ((serverfd = open_clientfd_timeout(host, port, CONNECT_TIMEOUT)) < 0)
+        return -1;
+    if (rio_writen(rp->rio_fd, established, strlen(established)) < 0) {
+        close(serverfd);
+        return -2;
+    }
+    *status = 200;
+
+    /* The client may have sent tunnelled bytes along with the request */
+    rc = 0;
+    n = 0;
+    if (rp->rio_cnt > 0 && (n = rio_peekb(rp, &data, rp->rio_cnt)) > 0) {
+        if (rio_writen(serverfd, data, n) < 0)
+            rc = -2;
+        rio_consumeb(rp, n);
+    }
+    if (rc == 0 && tunnel_relay(rp->rio_fd, serverfd, TUNNEL_TIMEOUT, &up, &down) < 0)
+        rc = -2;
+    if (n > 0)
+        up += n;
+
+    alog_printf("Tunnel to %s:%s closed: %ld bytes up, %ld bytes down", host, port, up, down);
+    *bytes = down;
+    close(serverfd);
+    return rc;
+}
+
+/*
+ * proxy_request - fetch url from the cache or the origin server and
+ *     relay it to connfd. Returns 0 on success, -1 with errno set if
+ *     nothing has been sent to the client yet (so an error page can
+ *     still be), or -2 with errno set if the relay broke off midway.
+ *     Reading the response is bounded by REQUEST_TIMEOUT in all, so a
+ *     stalled origin costs the thread at most that. Writes to the
+ *     client are bounded one at a time by IO_TIMEOUT only: a client
+ *     that keeps reading, however slowly, holds the thread until the
+ *     response is through.
+ */
+int proxy_request(int connfd, char *req_buf, char *host, char *port, char *url, int *status, long *bytes) {
     rio_t rp;
-    char buf[MAXLINE];
     char object[MAX_OBJECT_SIZE];
     char *obj_ptr = object;
     char *obj_ptr_end = object + MAX_OBJECT_SIZE;
-    int save_to_cache = 1;
+    char *data, status_line[32];
+    int save_to_cache = 1, last, rc = 0;
     ssize_t n;
 
     /* search cache first */
     if ((n = read_cache(&cache, url, object, MAX_OBJECT_SIZE)) > 0) {
-        Rio_writen(connfd, object, n);
-        return 0;
+        sscanf(object, "%*s %d", status);
+        *bytes = n;
+        return rio_writen(connfd, object, n) < 0 ? -2 : 0;
     }
 
     int clientfd;
-    if ((clientfd = Open_clientfd(host, port)) < 0)
+    if ((clientfd = open_clientfd_timeout(host, port, CONNECT_TIMEOUT)) < 0)
         return -1;
     
     Rio_readinitb(&rp, clientfd);
+    rio_settimeout(&rp, IO_TIMEOUT, IO_TIMEOUT);
+    rio_setdeadline(&rp, REQUEST_TIMEOUT);
 
     /* write request to server */
-    Rio_writen(clientfd, req_buf, strlen(req_buf));
-
-    /* read header */
-    if (Rio_readlineb(&rp, buf, MAXLINE) <= 0) {
+    if (rio_writen(clientfd, req_buf, strlen(req_buf)) < 0) {
         close(clientfd);
         return -1;
     }
-    
-    if (obj_ptr + strlen(buf) < obj_ptr_end) {
-        strcpy(obj_ptr, buf);
-        obj_ptr += strlen(buf);
-    } else 
-        save_to_cache = 0;
-        
-    Rio_writen(connfd, buf, strlen(buf));
+
+    /* 
+     * Relay the response straight out of the rio buffer: each header
+     * line and body chunk is borrowed with rio_peeklineb/rio_peekb,
+     * written to the client and copied once into the cache object.
+     */
     do {
-        if (Rio_readlineb(&rp, buf, MAXLINE) <= 0) {
-            close(clientfd);
-            return -1;
+        if ((n = rio_peeklineb(&rp, &data)) <= 0) {
+            rc = (*bytes == 0) ? -1 : -2;
+            goto done;
         }
-
-        if (obj_ptr + strlen(buf) < obj_ptr_end) {
-            strcpy(obj_ptr, buf);
-            obj_ptr += strlen(buf);
+        if (obj_ptr == object) {
+            snprintf(status_line, sizeof(status_line), "%.*s", (int)n, data);
+            sscanf(status_line, "%*s %d", status);
+        }
+        if (obj_ptr + n < obj_ptr_end) {
+            memcpy(obj_ptr, data, n);
+            obj_ptr += n;
         } else 
             save_to_cache = 0;
-        Rio_writen(connfd, buf, strlen(buf));
-    } while (strcmp(buf, "\r\n"));
-
+        if (rio_writen(connfd, data, n) < 0) {
+            rc = -2;
+            goto done;
+        }
+        *bytes += n;
+        last = (n == 2 && !memcmp(data, "\r\n", 2));
+        rio_consumeb(&rp, n);
+    } while (!last);
 
     /* read data */
-    while ((n = Rio_readnb(&rp, buf, MAXLINE)) > 0) {
-        // printf("read %ld bytes, buf:%s\n", n, buf);
+    while ((n = rio_peekb(&rp, &data, RIO_BUFSIZE)) > 0) {
         if (obj_ptr + n <= obj_ptr_end) {
-            strncpy(obj_ptr, buf, n);
+            memcpy(obj_ptr, data, n);
             obj_ptr += n;
         } else 
             save_to_cache = 0;
-        Rio_writen(connfd, buf, n);
+        if (rio_writen(connfd, data, n) < 0) {
+            rc = -2;
+            goto done;
+        }
+        *bytes += n;
+        rio_consumeb(&rp, n);
     }
-    
-    /* error handling */
-    close(clientfd);
     if (n < 0)
-        return -1;
+        rc = -2;
     
     /* save to cache if possible */
-    write_cache(&cache, url, object, obj_ptr - object);
-    return 0;
+    else if (save_to_cache)
+        write_cache(&cache, url, object, obj_ptr - object);
+
+ done:
+    rio_freeb(&rp);
+    close(clientfd);
+    return rc;
 }   
 
 void debug_respond(int fd, char *msg) {
@@ -242,24 +465,19 @@ void debug_respond(int fd, char *msg) {
 void clienterror(int fd, char *cause, char *errnum, 
 		 char *shortmsg, char *longmsg) 
 {
-    char buf[MAXLINE];
+    resp_t rb;
 
     /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    resp_init(&rb);
+    resp_printf(&rb, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
+    resp_printf(&rb, "Content-type: text/html\r\n\r\n");
 
     /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    resp_printf(&rb, "<html><title>Tiny Error</title>");
+    resp_printf(&rb, "<body bgcolor=""ffffff"">\r\n");
+    resp_printf(&rb, "%s: %s\r\n", errnum, shortmsg);
+    resp_printf(&rb, "<p>%s: %.*s\r\n", longmsg, MAXLINE, cause);
+    resp_printf(&rb, "<hr><em>The Tiny Web server</em>\r\n");
+    resp_flush(fd, &rb, 0);       /* One writev for the whole page */
 }
 /* $end clienterror */
\ No newline at end of file
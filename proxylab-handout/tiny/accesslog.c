@@ -0,0 +1,247 @@
+/*
+ * accesslog.c - asynchronous access log
+ *
+ * Serving threads never write to the log file themselves. A record is
+ * formatted into a slot of a bounded multi-producer/single-consumer
+ * ring (Vyukov's sequence-numbered array queue), which costs one
+ * compare-and-swap and no locks or system calls. A background thread
+ * wakes every flush interval, drains the ring into a batch buffer and
+ * hands it to the kernel in as few write() calls as possible.
+ *
+ * If the ring is full the record is dropped rather than blocking the
+ * request; the number of dropped records is reported in the log. When
+ * logging to a file, the file is renamed to <path>.1 and reopened once
+ * it grows past the rotation size.
+ */
+#include <time.h>
+#include "accesslog.h"
+
+typedef struct {
+    size_t seq;               /* Ring position this slot is ready for */
+    int len;
+    char data[ALOG_RECSIZE];
+} alog_slot_t;
+
+typedef struct {
+    alog_slot_t *ring;
+    size_t head;              /* Next position to claim (producers) */
+    size_t tail;              /* Next position to drain (writer) */
+    unsigned long dropped;
+    unsigned long dropped_reported;
+    int fd;
+    char *path;               /* NULL when logging to stdout */
+    size_t filesize;
+    size_t rotate_size;
+    int flush_ms;
+    volatile int stop;
+    pthread_t tid;
+    char batch[ALOG_BATCHSIZE];
+    size_t batchlen;
+} alog_t;
+
+static alog_t *alog = NULL;
+
+static void *writer(void *vargp);
+static int drain(void);
+static void flush_batch(void);
+static void rotate(void);
+
+/*
+ * alog_init - start logging to path (stdout if NULL), writing batches
+ *     every flush_ms milliseconds and rotating the file once it grows
+ *     past rotate_size bytes (0 disables rotation). Returns -1 if the
+ *     file can't be opened.
+ */
+int alog_init(char *path, int flush_ms, size_t rotate_size) 
+{
+    size_t i;
+    int fd = STDOUT_FILENO;
+    struct stat sbuf;
+
+    if (path != NULL && 
+        (fd = open(path, O_WRONLY | O_CREAT | O_APPEND, DEF_MODE)) < 0)
+        return -1;
+
+    alog = Calloc(1, sizeof(alog_t));
+    alog->ring = Malloc(ALOG_SLOTS * sizeof(alog_slot_t));
+    for (i = 0; i < ALOG_SLOTS; i++)
+        alog->ring[i].seq = i;
+    alog->fd = fd;
+    if (path != NULL) {
+        alog->path = Malloc(strlen(path) + 1);
+        strcpy(alog->path, path);
+        if (fstat(fd, &sbuf) == 0)
+            alog->filesize = sbuf.st_size;
+    }
+    alog->rotate_size = rotate_size;
+    alog->flush_ms = flush_ms > 0 ? flush_ms : ALOG_FLUSH_MS;
+    Pthread_create(&alog->tid, NULL, writer, NULL);
+    return 0;
+}
+
+/*
+ * alog_printf - queue one log record. A trailing newline is added if
+ *     the formatted text lacks one. Never blocks.
+ */
+void alog_printf(const char *fmt, ...) 
+{
+    size_t pos, seq;
+    alog_slot_t *slot;
+    va_list ap;
+    int len;
+
+    if (alog == NULL)
+        return;
+
+    /* Claim a slot */
+    pos = __atomic_load_n(&alog->head, __ATOMIC_RELAXED);
+    for (;;) {
+        slot = &alog->ring[pos & (ALOG_SLOTS - 1)];
+        seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq == pos) {
+            if (__atomic_compare_exchange_n(&alog->head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;  /* On failure pos is reloaded */
+        } else if ((long)(seq - pos) < 0) {  /* Full */
+            __atomic_fetch_add(&alog->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else
+            pos = __atomic_load_n(&alog->head, __ATOMIC_RELAXED);
+    }
+
+    /* Fill and publish it */
+    va_start(ap, fmt);
+    len = vsnprintf(slot->data, ALOG_RECSIZE, fmt, ap);
+    va_end(ap);
+    if (len < 0)
+        len = 0;
+    if (len > ALOG_RECSIZE - 1)
+        len = ALOG_RECSIZE - 1;
+    if (len == 0 || slot->data[len - 1] != '\n')
+        slot->data[len++] = '\n';  /* Overwrites the NUL, if need be */
+    slot->len = len;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * alog_access - queue a request record in Common Log Format
+ */
+void alog_access(char *client, char *request, int status, long bytes) 
+{
+    char date[64];
+    struct tm tm;
+    time_t now = time(NULL);
+
+    localtime_r(&now, &tm);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &tm);
+    alog_printf("%s - - [%s] \"%.*s\" %d %ld", client, date, 
+                (int)strcspn(request, "\r\n"), request, status, bytes);
+}
+
+unsigned long alog_dropped(void) 
+{
+    return alog ? __atomic_load_n(&alog->dropped, __ATOMIC_RELAXED) : 0;
+}
+
+/*
+ * alog_close - write out everything queued so far and stop the writer
+ */
+void alog_close(void) 
+{
+    if (alog == NULL)
+        return;
+    alog->stop = 1;
+    Pthread_join(alog->tid, NULL);
+    if (alog->path != NULL)
+        close(alog->fd);
+    free(alog->path);
+    free(alog->ring);
+    free(alog);
+    alog = NULL;
+}
+
+/* writer - background thread: drain and flush every flush_ms */
+static void *writer(void *vargp) 
+{
+    struct timespec ts;
+
+    ts.tv_sec = alog->flush_ms / 1000;
+    ts.tv_nsec = (alog->flush_ms % 1000) * 1000000L;
+    for (;;) {
+        int stop = alog->stop;
+
+        while (drain())
+            ;
+        flush_batch();
+        if (stop)
+            return NULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* 
+ * drain - move published records into the batch buffer, flushing it
+ *     when full. Returns the number of records moved.
+ */
+static int drain(void) 
+{
+    alog_slot_t *slot;
+    unsigned long dropped;
+    int n = 0;
+
+    dropped = __atomic_load_n(&alog->dropped, __ATOMIC_RELAXED);
+    if (dropped != alog->dropped_reported) {
+        char msg[64];
+        int len = sprintf(msg, "# accesslog: %lu records dropped\n", 
+                          dropped - alog->dropped_reported);
+        if (alog->batchlen + len > ALOG_BATCHSIZE)
+            flush_batch();
+        memcpy(alog->batch + alog->batchlen, msg, len);
+        alog->batchlen += len;
+        alog->dropped_reported = dropped;
+    }
+
+    for (;;) {
+        slot = &alog->ring[alog->tail & (ALOG_SLOTS - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != alog->tail + 1)
+            return n;  /* Not published yet */
+        if (alog->batchlen + slot->len > ALOG_BATCHSIZE)
+            flush_batch();
+        memcpy(alog->batch + alog->batchlen, slot->data, slot->len);
+        alog->batchlen += slot->len;
+        /* Hand the slot back to producers one lap later */
+        __atomic_store_n(&slot->seq, alog->tail + ALOG_SLOTS, __ATOMIC_RELEASE);
+        alog->tail++;
+        n++;
+    }
+}
+
+/* flush_batch - write the batch buffer out, rotating first if due */
+static void flush_batch(void) 
+{
+    if (alog->batchlen == 0)
+        return;
+    if (alog->path != NULL && alog->rotate_size > 0 && alog->filesize > 0 &&
+        alog->filesize + alog->batchlen > alog->rotate_size)
+        rotate();
+    /* Errors are dropped: there is nowhere to report them */
+    if (rio_writen(alog->fd, alog->batch, alog->batchlen) > 0)
+        alog->filesize += alog->batchlen;
+    alog->batchlen = 0;
+}
+
+/* rotate - move the log to <path>.1 and start a new one */
+static void rotate(void) 
+{
+    char oldpath[MAXLINE];
+    int fd;
+
+    snprintf(oldpath, MAXLINE, "%s.1", alog->path);
+    if (rename(alog->path, oldpath) < 0)
+        return;
+    if ((fd = open(alog->path, O_WRONLY | O_CREAT | O_APPEND, DEF_MODE)) < 0)
+        return;  /* Keep writing to the renamed file */
+    close(alog->fd);
+    alog->fd = fd;
+    alog->filesize = 0;
+}
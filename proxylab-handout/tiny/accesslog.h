@@ -0,0 +1,25 @@
+/*
+ * accesslog.h - asynchronous access log
+ */
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include "csapp.h"
+
+#define ALOG_SLOTS       4096        /* Ring capacity, a power of two */
+#define ALOG_RECSIZE     512         /* Longer records are truncated */
+#define ALOG_BATCHSIZE   (64 * 1024) /* Bytes handed to one write() */
+#define ALOG_FLUSH_MS    100         /* Default flush interval */
+#define ALOG_ROTATE_SIZE (64 << 20)  /* Default size that triggers rotation */
+
+int alog_init(char *path, int flush_ms, size_t rotate_size);
+
+void alog_printf(const char *fmt, ...);
+
+void alog_access(char *client, char *request, int status, long bytes);
+
+unsigned long alog_dropped(void);
+
+void alog_close(void);
+
+#endif
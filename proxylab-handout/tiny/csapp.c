@@ -1,6 +1,35 @@
 /* 
  * csapp.c - Functions for the CS:APP3e book
  *
+ * Updated: added a bounded lock-free MPMC queue (mpmc_t) for
+ *   prethreaded servers, in place of a semaphore-protected sbuf.
+ *
+ * Updated: open_clientfd races the server's addresses with staggered
+ *   starts (RFC 8305 happy eyeballs) and tries the address that last
+ *   worked for a host first.
+ *
+ * Updated: timeouts. open_clientfd_timeout connects with a
+ *   non-blocking connect and poll; rio_settimeout and rio_setdeadline
+ *   bound reads and writes per call and per request. Operations that
+ *   time out fail with ETIMEDOUT and are counted (timeout_counts).
+ *
+ * Updated: a response builder (resp_t) gathers header lines and
+ *   borrowed body buffers and sends them with one writev, optionally
+ *   with MSG_MORE.
+ *
+ * Updated: non-blocking Rio for event loops. rio_tryreadnb and
+ *   rio_tryreadlineb return EAGAIN without losing buffered bytes, and
+ *   a rio_wq_t write queue sends fragments with writev, remembering
+ *   how far a partial write got.
+ *
+ * Updated: the Rio buffer can be resized (rio_resizeb), and
+ *   rio_peekb/rio_peeklineb/rio_consumeb let callers work on bytes in
+ *   place in the internal buffer instead of copying them out.
+ *
+ * Updated: rio_readlineb scans the internal buffer for the newline
+ *   with memchr and copies the whole line with one memcpy instead of
+ *   moving one byte per rio_read call.
+ *
  * Updated 10/2016 reb:
  *   - Fixed bug in sio_ltoa that didn't cover negative numbers
  *
@@ -738,10 +767,314 @@ void V(sem_t *sem)
 	unix_error("V error");
 }
 
+/**************************************************
+ * Bounded multi-producer/multi-consumer queue
+ *
+ * A ring of cells, each with a sequence number that says which lap
+ * of the ring it is ready for (Vyukov's bounded MPMC queue). A put
+ * claims a position with one compare-and-swap on head and a get with
+ * one on tail, so producers and consumers don't contend with each
+ * other, and nothing is locked while the queue is neither empty nor
+ * full. A waiter spins for q->spins tries before it sleeps on a
+ * condition variable; the other side only touches the mutex when it
+ * sees that someone is asleep.
+ **************************************************/
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+/*
+ * mpmc_init - Make an empty queue of n slots, n a power of two >= 2.
+ *    Waiters try spins times before sleeping (MPMC_SPINS is a good
+ *    default; 0 sleeps at once). On a uniprocessor they never spin.
+ *    Returns -1 on error.
+ */
+int mpmc_init(mpmc_t *q, size_t n, int spins)
+{
+    size_t i;
+
+    if (n < 2 || (n & (n - 1)) != 0) {
+	errno = EINVAL;
+	return -1;
+    }
+    if ((q->cells = malloc(n * sizeof(mpmc_cell_t))) == NULL)
+	return -1;
+    for (i = 0; i < n; i++)
+	q->cells[i].seq = i;
+    q->mask = n - 1;
+    q->spins = spins;
+    if (sysconf(_SC_NPROCESSORS_ONLN) == 1)
+	q->spins = 0;   /* Nobody can make progress while we spin */
+    q->head = 0;
+    q->tail = 0;
+    q->nget_waiting = 0;
+    q->nput_waiting = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notempty, NULL);
+    pthread_cond_init(&q->notfull, NULL);
+    return 0;
+}
+
+/*
+ * mpmc_deinit - Free a queue nobody is using any more
+ */
+void mpmc_deinit(mpmc_t *q)
+{
+    free(q->cells);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notempty);
+    pthread_cond_destroy(&q->notfull);
+}
+
+/*
+ * mpmc_enq, mpmc_deq - Put or get without waking anybody. Return 0,
+ *    or -1 if the queue is full (empty).
+ */
+static int mpmc_enq(mpmc_t *q, void *item)
+{
+    mpmc_cell_t *c;
+    size_t pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    long dif;
+
+    for (;;) {
+	c = &q->cells[pos & q->mask];
+	dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - pos);
+	if (dif == 0) {       /* Free on this lap: claim it */
+	    if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (dif < 0)     /* Still holds last lap's item */
+	    return -1;
+	else                  /* Another producer got there first */
+	    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    }
+    c->item = item;
+    __atomic_store_n(&c->seq, pos + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int mpmc_deq(mpmc_t *q, void **itemp)
+{
+    mpmc_cell_t *c;
+    size_t pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    long dif;
+
+    for (;;) {
+	c = &q->cells[pos & q->mask];
+	dif = (long)(__atomic_load_n(&c->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+	if (dif == 0) {       /* Filled on this lap: claim it */
+	    if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, 1,
+					    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		break;
+	}
+	else if (dif < 0)     /* Not filled yet */
+	    return -1;
+	else                  /* Another consumer got there first */
+	    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    }
+    *itemp = c->item;
+    __atomic_store_n(&c->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*
+ * mpmc_wake - Wake one sleeper counted in *nwaiting. The fence pairs
+ *    with the one in mpmc_wait: either the sleeper sees our item or
+ *    we see the sleeper.
+ */
+static void mpmc_wake(mpmc_t *q, int *nwaiting, pthread_cond_t *cond)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(nwaiting, __ATOMIC_RELAXED) > 0) {
+	pthread_mutex_lock(&q->lock);
+	pthread_cond_signal(cond);
+	pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/*
+ * mpmc_wait - Put item (or get into *itemp) once there is room (an
+ *    item), spinning first and then sleeping for up to timeout_ms
+ *    (forever if negative). Returns 0, or -1 with errno ETIMEDOUT.
+ */
+static int mpmc_wait(mpmc_t *q, int put, void *item, void **itemp,
+		     int timeout_ms)
+{
+    int i, rc = 0, *nwaiting = put ? &q->nput_waiting : &q->nget_waiting;
+    pthread_cond_t *cond = put ? &q->notfull : &q->notempty;
+    struct timespec abstime;
+
+#define MPMC_TRY() (put ? mpmc_enq(q, item) : mpmc_deq(q, itemp))
+    for (i = 0; i < q->spins; i++) {
+	if (MPMC_TRY() == 0)
+	    goto done;
+	cpu_relax();
+    }
+    if (timeout_ms >= 0) {
+	clock_gettime(CLOCK_REALTIME, &abstime);
+	abstime.tv_sec += timeout_ms / 1000;
+	abstime.tv_nsec += (timeout_ms % 1000) * 1000000L;
+	if (abstime.tv_nsec >= 1000000000L) {
+	    abstime.tv_sec++;
+	    abstime.tv_nsec -= 1000000000L;
+	}
+    }
+
+    pthread_mutex_lock(&q->lock);
+    __atomic_fetch_add(nwaiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (MPMC_TRY() < 0) {
+	if (timeout_ms < 0)
+	    pthread_cond_wait(cond, &q->lock);
+	else if (pthread_cond_timedwait(cond, &q->lock, &abstime) == ETIMEDOUT) {
+	    rc = MPMC_TRY();  /* Last chance */
+	    break;
+	}
+    }
+    __atomic_fetch_sub(nwaiting, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&q->lock);
+#undef MPMC_TRY
+    if (rc < 0) {
+	errno = ETIMEDOUT;
+	return -1;
+    }
+
+ done:
+    if (put)
+	mpmc_wake(q, &q->nget_waiting, &q->notempty);
+    else
+	mpmc_wake(q, &q->nput_waiting, &q->notfull);
+    return 0;
+}
+
+/*
+ * mpmc_tryput, mpmc_tryget - Put or get without waiting. Return 0, or
+ *    -1 with errno EAGAIN if the queue is full (empty).
+ */
+int mpmc_tryput(mpmc_t *q, void *item)
+{
+    if (mpmc_enq(q, item) < 0) {
+	errno = EAGAIN;
+	return -1;
+    }
+    mpmc_wake(q, &q->nget_waiting, &q->notempty);
+    return 0;
+}
+
+int mpmc_tryget(mpmc_t *q, void **itemp)
+{
+    if (mpmc_deq(q, itemp) < 0) {
+	errno = EAGAIN;
+	return -1;
+    }
+    mpmc_wake(q, &q->nput_waiting, &q->notfull);
+    return 0;
+}
+
+/*
+ * mpmc_put, mpmc_get - Put or get, waiting as long as it takes
+ */
+void mpmc_put(mpmc_t *q, void *item)
+{
+    mpmc_wait(q, 1, item, NULL, -1);
+}
+
+void *mpmc_get(mpmc_t *q)
+{
+    void *item;
+
+    mpmc_wait(q, 0, NULL, &item, -1);
+    return item;
+}
+
+/*
+ * mpmc_timedput, mpmc_timedget - Put or get, waiting at most
+ *    timeout_ms milliseconds. Return 0, or -1 with errno ETIMEDOUT.
+ */
+int mpmc_timedput(mpmc_t *q, void *item, int timeout_ms)
+{
+    return mpmc_wait(q, 1, item, NULL, timeout_ms);
+}
+
+int mpmc_timedget(mpmc_t *q, void **itemp, int timeout_ms)
+{
+    return mpmc_wait(q, 0, NULL, itemp, timeout_ms);
+}
+
 /****************************************
  * The Rio package - Robust I/O functions
  ****************************************/
 
+/* Operations that failed with ETIMEDOUT, for timeout_counts */
+static struct {
+    unsigned long connect;
+    unsigned long read;
+    unsigned long write;
+} ntimeouts;
+
+/*
+ * timed_out - Count a timeout in *counter and fail with ETIMEDOUT
+ */
+static int timed_out(unsigned long *counter)
+{
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+    errno = ETIMEDOUT;
+    return -1;
+}
+
+/*
+ * now_ms - Milliseconds on the monotonic clock
+ */
+static long long now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * rio_wait - Before a read on rp, wait for input until the deadline
+ *    set by rio_setdeadline, if any, or the per-read timeout if that
+ *    comes first. Returns 0 when the read may go ahead, or -1 with
+ *    errno set to ETIMEDOUT.
+ */
+static int rio_wait(rio_t *rp)
+{
+    struct pollfd pfd;
+    long long left;
+    int rc;
+
+    if (rp->rio_deadline == 0)
+	return 0;
+    pfd.fd = rp->rio_fd;
+    pfd.events = POLLIN;
+    do {
+	if ((left = rp->rio_deadline - now_ms()) <= 0)
+	    return timed_out(&ntimeouts.read);
+	if (rp->rio_timeout > 0 && rp->rio_timeout < left)
+	    left = rp->rio_timeout;
+    } while ((rc = poll(&pfd, 1, left)) < 0 && errno == EINTR);
+    if (rc == 0)
+	return timed_out(&ntimeouts.read);
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * rio_readerr - Decide what a failed read() on rp means. EAGAIN from
+ *    a socket with a receive timeout is that timeout expiring.
+ */
+static ssize_t rio_readerr(rio_t *rp)
+{
+    if (rp->rio_timeout > 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	return timed_out(&ntimeouts.read);
+    return -1;
+}
+
 /*
  * rio_readn - Robustly read n bytes (unbuffered)
  */
@@ -782,6 +1115,8 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 	if ((nwritten = write(fd, bufp, nleft)) <= 0) {
 	    if (errno == EINTR)  /* Interrupted by sig handler return */
 		nwritten = 0;    /* and call write() again */
+	    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+		return timed_out(&ntimeouts.write); /* SO_SNDTIMEO expired */
 	    else
 		return -1;       /* errno set by write() */
 	}
@@ -793,6 +1128,33 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n)
 /* $end rio_writen */
 
 
+/*
+ * rio_fill - Refill the internal buffer if it is empty. Returns the
+ *    number of unread bytes, 0 on EOF, or -1 on error.
+ */
+static ssize_t rio_fill(rio_t *rp)
+{
+    ssize_t nread;
+
+    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
+	if (rio_wait(rp) < 0)
+	    return -1;
+	nread = read(rp->rio_fd, rp->rio_bufbase, rp->rio_bufsize);
+	if (nread < 0) {
+	    rp->rio_cnt = 0;    /* Keep the buffer usable after EAGAIN */
+	    if (errno != EINTR) /* Interrupted by sig handler return */
+		return rio_readerr(rp);
+	}
+	else if (nread == 0)    /* EOF */
+	    return 0;
+	else {
+	    rp->rio_cnt = nread;
+	    rp->rio_bufptr = rp->rio_bufbase; /* Reset buffer ptr */
+	}
+    }
+    return rp->rio_cnt;
+}
+
 /* 
  * rio_read - This is a wrapper for the Unix read() function that
  *    transfers min(n, rio_cnt) bytes from an internal buffer to a user
@@ -806,18 +1168,8 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n)
 {
     int cnt;
 
-    while (rp->rio_cnt <= 0) {  /* Refill if buf is empty */
-	rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
-			   sizeof(rp->rio_buf));
-	if (rp->rio_cnt < 0) {
-	    if (errno != EINTR) /* Interrupted by sig handler return */
-		return -1;
-	}
-	else if (rp->rio_cnt == 0)  /* EOF */
-	    return 0;
-	else 
-	    rp->rio_bufptr = rp->rio_buf; /* Reset buffer ptr */
-    }
+    if ((cnt = rio_fill(rp)) <= 0)
+	return cnt;
 
     /* Copy min(n, rp->rio_cnt) bytes from internal buf to user buf */
     cnt = n;          
@@ -839,9 +1191,180 @@ void rio_readinitb(rio_t *rp, int fd)
     rp->rio_fd = fd;  
     rp->rio_cnt = 0;  
     rp->rio_bufptr = rp->rio_buf;
+    rp->rio_bufbase = rp->rio_buf;
+    rp->rio_bufsize = RIO_BUFSIZE;
+    rp->rio_timeout = 0;
+    rp->rio_deadline = 0;
 }
 /* $end rio_readinitb */
 
+/*
+ * rio_settimeout - Bound each read() and write() on the socket behind
+ *    rp to read_ms and write_ms milliseconds (0 for no limit), using
+ *    SO_RCVTIMEO and SO_SNDTIMEO so the kernel enforces them at no
+ *    extra cost per call. Reads through rp and rio_writen on the
+ *    socket then fail with ETIMEDOUT instead of blocking forever.
+ */
+int rio_settimeout(rio_t *rp, int read_ms, int write_ms)
+{
+    struct timeval tv;
+
+    tv.tv_sec = read_ms / 1000;
+    tv.tv_usec = (read_ms % 1000) * 1000;
+    if (setsockopt(rp->rio_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+	return -1;
+    tv.tv_sec = write_ms / 1000;
+    tv.tv_usec = (write_ms % 1000) * 1000;
+    if (setsockopt(rp->rio_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+	return -1;
+    rp->rio_timeout = read_ms;
+    return 0;
+}
+
+/*
+ * rio_setdeadline - Make reads through rp fail with ETIMEDOUT once ms
+ *    milliseconds have passed, however the time is split between
+ *    reads. This bounds a whole request, where rio_settimeout only
+ *    bounds each read. ms of 0 removes the deadline.
+ */
+void rio_setdeadline(rio_t *rp, int ms)
+{
+    rp->rio_deadline = ms > 0 ? now_ms() + ms : 0;
+}
+
+/*
+ * rio_resizeb - Change the size of the internal buffer, keeping any
+ *    unread bytes. Sizes up to RIO_BUFSIZE use the buffer inside rio_t;
+ *    larger ones are malloc'd and must be released with rio_freeb.
+ *    Returns -1 if size can't hold the unread bytes or malloc fails.
+ */
+int rio_resizeb(rio_t *rp, size_t size)
+{
+    char *newbuf;
+
+    if (size == 0 || size < rp->rio_cnt) {
+	errno = EINVAL;
+	return -1;
+    }
+    if (size <= RIO_BUFSIZE)
+	newbuf = rp->rio_buf;
+    else if ((newbuf = malloc(size)) == NULL)
+	return -1;
+    if (rp->rio_cnt > 0)
+	memmove(newbuf, rp->rio_bufptr, rp->rio_cnt);
+    if (rp->rio_bufbase != rp->rio_buf && rp->rio_bufbase != newbuf)
+	free(rp->rio_bufbase);
+    rp->rio_bufbase = newbuf;
+    rp->rio_bufptr = newbuf;
+    rp->rio_bufsize = size;
+    return 0;
+}
+
+/*
+ * rio_freeb - Release a buffer allocated by rio_resizeb. Unread
+ *    bytes are discarded.
+ */
+void rio_freeb(rio_t *rp)
+{
+    if (rp->rio_bufbase != rp->rio_buf)
+	free(rp->rio_bufbase);
+    rp->rio_cnt = 0;
+    rp->rio_bufptr = rp->rio_buf;
+    rp->rio_bufbase = rp->rio_buf;
+    rp->rio_bufsize = RIO_BUFSIZE;
+}
+
+/*
+ * rio_peekb - Borrow up to n unread bytes without copying them. Sets
+ *    *bufp to the next unread byte in the internal buffer, refilling
+ *    it first if it is empty. The bytes stay unread until passed to
+ *    rio_consumeb, and *bufp is valid until the next call on rp.
+ *    Returns the number of bytes available (<= n), 0 on EOF, -1 on
+ *    error.
+ */
+ssize_t rio_peekb(rio_t *rp, char **bufp, size_t n)
+{
+    ssize_t rc;
+
+    if ((rc = rio_fill(rp)) <= 0)
+	return rc;
+    *bufp = rp->rio_bufptr;
+    return (n < rp->rio_cnt) ? n : rp->rio_cnt;
+}
+
+/*
+ * rio_readmore - Read more bytes behind the unread ones, moving those
+ *    to the front of the buffer if there is no room after them. The
+ *    caller makes sure the buffer isn't full. Returns the number of
+ *    bytes read, 0 on EOF, -1 on error.
+ */
+static ssize_t rio_readmore(rio_t *rp)
+{
+    char *end = rp->rio_bufbase + rp->rio_bufsize;
+    ssize_t nread;
+
+    if (rp->rio_bufptr + rp->rio_cnt == end) {
+	memmove(rp->rio_bufbase, rp->rio_bufptr, rp->rio_cnt);
+	rp->rio_bufptr = rp->rio_bufbase;
+    }
+    if (rio_wait(rp) < 0)
+	return -1;
+    while ((nread = read(rp->rio_fd, rp->rio_bufptr + rp->rio_cnt,
+			 end - (rp->rio_bufptr + rp->rio_cnt))) < 0)
+	if (errno != EINTR) /* Interrupted by sig handler return */
+	    return rio_readerr(rp);
+    rp->rio_cnt += nread;
+    return nread;
+}
+
+/*
+ * rio_peeklineb - Borrow the next text line without copying it. Sets
+ *    *linep to the line in the internal buffer; it includes the
+ *    newline but is not NUL-terminated. A line that doesn't fit grows
+ *    the buffer, up to RIO_MAXBUFSIZE; past that, or at EOF, the
+ *    partial line is returned. Consume the line with rio_consumeb.
+ *    Returns the line length, 0 on EOF, -1 on error.
+ */
+ssize_t rio_peeklineb(rio_t *rp, char **linep)
+{
+    size_t scanned = 0;
+    ssize_t rc;
+    char *nl;
+
+    if (rp->rio_cnt <= 0)
+	rp->rio_bufptr = rp->rio_bufbase;
+    for (;;) {
+	if (rp->rio_cnt > scanned &&
+	    (nl = memchr(rp->rio_bufptr + scanned, '\n', 
+			 rp->rio_cnt - scanned)) != NULL) {
+	    *linep = rp->rio_bufptr;
+	    return nl - rp->rio_bufptr + 1;
+	}
+	scanned = rp->rio_cnt;
+	if (rp->rio_cnt == rp->rio_bufsize &&
+	    (rp->rio_bufsize >= RIO_MAXBUFSIZE ||
+	     rio_resizeb(rp, 2 * rp->rio_bufsize) < 0))
+	    break;        /* Longer than we are willing to buffer */
+	if ((rc = rio_readmore(rp)) < 0)
+	    return -1;
+	if (rc == 0)
+	    break;        /* EOF */
+    }
+    *linep = rp->rio_bufptr;
+    return rp->rio_cnt;
+}
+
+/*
+ * rio_consumeb - Mark n borrowed bytes as read
+ */
+void rio_consumeb(rio_t *rp, size_t n)
+{
+    if (n > rp->rio_cnt)
+	n = rp->rio_cnt;
+    rp->rio_bufptr += n;
+    rp->rio_cnt -= n;
+}
+
 /*
  * rio_readnb - Robustly read n bytes (buffered)
  */
@@ -865,34 +1388,290 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /* 
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readlineb - Robustly read a text line (buffered). The newline
+ *    is located with memchr over the unread part of the internal
+ *    buffer, which libc vectorizes, and each run of bytes up to it
+ *    is copied out in one piece.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-        if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n') {
-                n++;
-     		break;
-            }
-	} else if (rc == 0) {
-	    if (n == 1)
+    size_t n = 0, cnt;
+    ssize_t rc;
+    char *bufp = usrbuf, *nl = NULL;
+
+    if (maxlen == 0)
+	return 0;
+    while (n < maxlen - 1 && nl == NULL) { 
+        if ((rc = rio_fill(rp)) < 0)
+	    return -1;	  /* Error */
+	if (rc == 0) {
+	    if (n == 0)
 		return 0; /* EOF, no data read */
 	    else
 		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* Error */
+	}
+
+	/* Take up to the newline, or all we have room for */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((nl = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = nl - rp->rio_bufptr + 1;
+	memcpy(bufp, rp->rio_bufptr, cnt);
+	bufp += cnt;
+	n += cnt;
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
     }
     *bufp = 0;
-    return n-1;
+    return n;
 }
 /* $end rio_readlineb */
 
+/*
+ * The rio_try* functions are for non-blocking descriptors driven by
+ *    an event loop. rio_readnb and rio_readlineb may already have
+ *    taken bytes off the buffer when read() fails with EAGAIN, and
+ *    those bytes are lost; the try variants never consume anything
+ *    unless they can return it, so the caller just waits for the
+ *    descriptor to become readable and calls them again.
+ */
+
+/*
+ * rio_tryreadnb - Read up to n bytes that are already buffered or
+ *    can be read without blocking. Returns the number of bytes read,
+ *    0 on EOF, or -1 with errno set to EAGAIN if nothing is available
+ *    yet (or to something else on error).
+ */
+ssize_t rio_tryreadnb(rio_t *rp, void *usrbuf, size_t n)
+{
+    if (n == 0)
+	return 0;
+    return rio_read(rp, usrbuf, n);
+}
+
+/*
+ * rio_tryreadlineb - Read a text line if a whole one is available
+ *    without blocking. A line is whole once its newline has arrived,
+ *    it fills maxlen-1 bytes, or EOF ends it. Otherwise the partial
+ *    line stays in the buffer (which grows as rio_peeklineb does) and
+ *    -1 is returned with errno set to EAGAIN. Returns the line length
+ *    with usrbuf NUL-terminated, 0 on EOF, -1 on error.
+ */
+ssize_t rio_tryreadlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    ssize_t n;
+    char *line;
+
+    if (maxlen == 0)
+	return 0;
+    if ((n = rio_peeklineb(rp, &line)) < 0 && rp->rio_cnt >= maxlen - 1) {
+	line = rp->rio_bufptr;   /* No newline yet, but usrbuf is full */
+	n = rp->rio_cnt;
+    }
+    if (n <= 0)
+	return n;  /* EOF, EAGAIN or error; unread bytes are kept */
+    if (n > maxlen - 1)
+	n = maxlen - 1;
+    memcpy(usrbuf, line, n);
+    ((char *)usrbuf)[n] = 0;
+    rio_consumeb(rp, n);
+    return n;
+}
+
+/*
+ * rio_wqinit - Empty a write queue
+ */
+void rio_wqinit(rio_wq_t *wq)
+{
+    wq->wq_head = 0;
+    wq->wq_cnt = 0;
+    wq->wq_pending = 0;
+}
+
+/*
+ * rio_wqpush - Queue n bytes at buf for writing. The bytes are not
+ *    copied, so buf must stay valid until the queue has been flushed
+ *    past it. Returns 0, or -1 with errno set to ENOBUFS if all
+ *    RIO_WQMAX slots are in use.
+ */
+int rio_wqpush(rio_wq_t *wq, void *buf, size_t n)
+{
+    if (n == 0)
+	return 0;
+    if (wq->wq_head + wq->wq_cnt == RIO_WQMAX) {
+	if (wq->wq_head == 0) {
+	    errno = ENOBUFS;
+	    return -1;
+	}
+	memmove(wq->wq_iov, wq->wq_iov + wq->wq_head, 
+		wq->wq_cnt * sizeof(struct iovec));
+	wq->wq_head = 0;
+    }
+    wq->wq_iov[wq->wq_head + wq->wq_cnt].iov_base = buf;
+    wq->wq_iov[wq->wq_head + wq->wq_cnt].iov_len = n;
+    wq->wq_cnt++;
+    wq->wq_pending += n;
+    return 0;
+}
+
+static ssize_t rio_wqsend(int fd, rio_wq_t *wq, int flags);
+
+/*
+ * rio_wqflush - Write as much of the queue as fd accepts, with one
+ *    writev per pass. Fully written fragments are dropped and a
+ *    partially written one is trimmed, so the next call picks up
+ *    where this one stopped. On a non-blocking fd, EAGAIN ends the
+ *    pass without being an error. Returns the number of bytes still
+ *    queued (0 once drained), or -1 on error.
+ */
+ssize_t rio_wqflush(int fd, rio_wq_t *wq)
+{
+    return rio_wqsend(fd, wq, 0);
+}
+
+/*
+ * rio_wqsend - rio_wqflush, passing flags such as MSG_MORE to
+ *    sendmsg. Without flags, or if fd isn't a socket, writev is used.
+ */
+static ssize_t rio_wqsend(int fd, rio_wq_t *wq, int flags)
+{
+    struct iovec *iov;
+    struct msghdr msg;
+    ssize_t nwritten;
+    size_t n;
+
+    while (wq->wq_cnt > 0) {
+	iov = wq->wq_iov + wq->wq_head;
+	if (flags) {
+	    memset(&msg, 0, sizeof(msg));
+	    msg.msg_iov = iov;
+	    msg.msg_iovlen = wq->wq_cnt;
+	    nwritten = sendmsg(fd, &msg, flags);
+	    if (nwritten < 0 && errno == ENOTSOCK) {
+		flags = 0;
+		continue;
+	    }
+	}
+	else
+	    nwritten = writev(fd, iov, wq->wq_cnt);
+	if (nwritten < 0) {
+	    if (errno == EINTR)  /* Interrupted by sig handler return */
+		continue;
+	    if (errno == EAGAIN || errno == EWOULDBLOCK)
+		break;           /* Socket buffer full; resume later */
+	    return -1;           /* errno set by writev() */
+	}
+	wq->wq_pending -= nwritten;
+	while (nwritten > 0) {
+	    n = iov->iov_len;
+	    if (n > nwritten) {
+		iov->iov_base = (char *)iov->iov_base + nwritten;
+		iov->iov_len -= nwritten;
+		break;
+	    }
+	    nwritten -= n;
+	    iov++;
+	    wq->wq_head++;
+	    wq->wq_cnt--;
+	}
+    }
+    if (wq->wq_cnt == 0)
+	wq->wq_head = 0;
+    return wq->wq_pending;
+}
+
+/*
+ * The response builder collects the pieces of an HTTP response so
+ *    that it goes out in one writev instead of one write per header
+ *    line. Header text is formatted into a buffer inside the resp_t,
+ *    and body fragments are borrowed, not copied: they must stay valid
+ *    until resp_flush returns.
+ */
+
+/*
+ * resp_init - Start an empty response
+ */
+void resp_init(resp_t *rb)
+{
+    rio_wqinit(&rb->resp_wq);
+    rb->resp_len = 0;
+}
+
+/*
+ * resp_printf - Append formatted text. Text that directly follows the
+ *    previous resp_printf shares its iovec. Returns -1 with errno set
+ *    to ENOBUFS, appending nothing, if the text doesn't fit.
+ */
+int resp_printf(resp_t *rb, const char *fmt, ...)
+{
+    rio_wq_t *wq = &rb->resp_wq;
+    struct iovec *last;
+    char *p = rb->resp_buf + rb->resp_len;
+    size_t room = RESP_BUFSIZE - rb->resp_len;
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(p, room, fmt, ap);
+    va_end(ap);
+    if (n < 0 || n >= room) {
+	errno = ENOBUFS;
+	return -1;
+    }
+    /* Only a non-empty queue has a last iovec to extend */
+    last = (wq->wq_cnt > 0) ? wq->wq_iov + wq->wq_head + wq->wq_cnt - 1 : NULL;
+    if (last != NULL && (char *)last->iov_base + last->iov_len == p) {
+	last->iov_len += n;
+	wq->wq_pending += n;
+    }
+    else if (rio_wqpush(wq, p, n) < 0)
+	return -1;
+    rb->resp_len += n;
+    return 0;
+}
+
+/*
+ * resp_addb - Append n bytes at buf without copying them
+ */
+int resp_addb(resp_t *rb, void *buf, size_t n)
+{
+    return rio_wqpush(&rb->resp_wq, buf, n);
+}
+
+/*
+ * resp_flush - Send everything appended so far and empty rb. If more
+ *    is set the data is sent with MSG_MORE, like a brief TCP_CORK: the
+ *    kernel holds a partial segment back for the next write, so
+ *    headers flushed ahead of a separately written body share packets
+ *    with it. Waits for the socket to drain if fd is non-blocking.
+ *    Returns 0, or -1 on error (ETIMEDOUT if a send timeout set with
+ *    rio_settimeout expired).
+ */
+int resp_flush(int fd, resp_t *rb, int more)
+{
+    struct pollfd pfd;
+    struct timeval tv;
+    socklen_t len = sizeof(tv);
+    ssize_t rc;
+
+    while ((rc = rio_wqsend(fd, &rb->resp_wq, more ? MSG_MORE : 0)) > 0) {
+	/* A blocking socket only stops early when SO_SNDTIMEO expires */
+	if (getsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, &len) == 0 &&
+	    (tv.tv_sec || tv.tv_usec))
+	    return timed_out(&ntimeouts.write);
+	pfd.fd = fd;
+	pfd.events = POLLOUT;
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+	    return -1;
+    }
+    if (rc < 0)
+	return -1;
+    resp_init(rb);
+    return 0;
+}
+
 /**********************************
  * Wrappers for robust I/O routines
  **********************************/
@@ -934,9 +1713,152 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 } 
 
+ssize_t Rio_peekb(rio_t *rp, char **bufp, size_t n) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_peekb(rp, bufp, n)) < 0)
+	unix_error("Rio_peekb error");
+    return rc;
+}
+
+ssize_t Rio_peeklineb(rio_t *rp, char **linep) 
+{
+    ssize_t rc;
+
+    if ((rc = rio_peeklineb(rp, linep)) < 0)
+	unix_error("Rio_peeklineb error");
+    return rc;
+}
+
+ssize_t Rio_wqflush(int fd, rio_wq_t *wq)
+{
+    ssize_t rc;
+
+    if ((rc = rio_wqflush(fd, wq)) < 0)
+	unix_error("Rio_wqflush error");
+    return rc;
+}
+
+void Resp_flush(int fd, resp_t *rb, int more)
+{
+    if (resp_flush(fd, rb, more) < 0)
+	unix_error("Resp_flush error");
+}
+
 /******************************** 
  * Client/server helper functions
  ********************************/
+/*
+ * Connections are opened the "happy eyeballs" way (RFC 8305): instead
+ * of waiting for each address in turn to connect or fail, a new
+ * attempt is started every HE_DELAY_MS while earlier ones are still
+ * pending, alternating between IPv6 and IPv4, and the first to
+ * connect wins. An address that silently drops SYNs (typically broken
+ * IPv6) then costs HE_DELAY_MS instead of a full connect timeout. The
+ * address that last won for a host and port is tried first next time.
+ */
+#define HE_DELAY_MS   250  /* Connection Attempt Delay of RFC 8305 */
+#define HE_MAXADDRS   16   /* Addresses raced per connection */
+#define HE_CACHESIZE  64   /* Hosts whose last good address is kept */
+#define HE_KEYSIZE    256  /* Longer "host:port" keys aren't cached */
+
+typedef struct {
+    char key[HE_KEYSIZE];     /* "host:port", empty if unused */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+} he_entry_t;
+
+static struct {
+    pthread_mutex_t lock;
+    he_entry_t slot[HE_CACHESIZE];
+} he_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * he_slot - find the cache slot for key, or NULL if key is too long
+ */
+static he_entry_t *he_slot(char *key, char *hostname, char *port)
+{
+    unsigned h = 2166136261u;    /* FNV-1a */
+    char *c;
+
+    if (snprintf(key, HE_KEYSIZE, "%s:%s", hostname, port) >= HE_KEYSIZE)
+	return NULL;
+    for (c = key; *c; c++)
+	h = (h ^ (unsigned char)*c) * 16777619u;
+    return &he_cache.slot[h % HE_CACHESIZE];
+}
+
+/*
+ * he_order - put up to HE_MAXADDRS addresses from listp into v in the
+ *     order they will be tried: the cached winner for key first, then
+ *     the rest alternating between families, starting with the family
+ *     getaddrinfo put first. Returns the number of addresses.
+ */
+static int he_order(struct addrinfo *listp, he_entry_t *e, char *key,
+		    struct addrinfo **v)
+{
+    struct addrinfo *p, *fam[2][HE_MAXADDRS];
+    int n = 0, cnt[2] = { 0, 0 }, i[2] = { 0, 0 }, f, first = -1;
+
+    pthread_mutex_lock(&he_cache.lock);
+    for (p = listp; p; p = p->ai_next) {
+	if (n == 0 && e != NULL && !strcmp(e->key, key) &&
+	    p->ai_addrlen == e->addrlen &&
+	    !memcmp(p->ai_addr, &e->addr, e->addrlen)) {
+	    v[n++] = p;           /* Last winner goes first */
+	    continue;
+	}
+	if (first < 0)
+	    first = p->ai_family;
+	f = (p->ai_family != first);
+	if (cnt[f] < HE_MAXADDRS)
+	    fam[f][cnt[f]++] = p;
+    }
+    pthread_mutex_unlock(&he_cache.lock);
+    for (f = 0; n < HE_MAXADDRS && (i[0] < cnt[0] || i[1] < cnt[1]); f ^= 1)
+	if (i[f] < cnt[f])
+	    v[n++] = fam[f][i[f]++];
+    return n;
+}
+
+/*
+ * he_remember - record addr as the one that worked for key
+ */
+static void he_remember(he_entry_t *e, char *key, struct addrinfo *p)
+{
+    if (e == NULL)
+	return;
+    pthread_mutex_lock(&he_cache.lock);
+    strcpy(e->key, key);
+    memcpy(&e->addr, p->ai_addr, p->ai_addrlen);
+    e->addrlen = p->ai_addrlen;
+    pthread_mutex_unlock(&he_cache.lock);
+}
+
+/*
+ * he_start - start a non-blocking connect to p. Returns the socket,
+ *     with *done set if it connected at once, or -1 with errno set.
+ */
+static int he_start(struct addrinfo *p, int *done)
+{
+    int fd, flags;
+
+    if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+	return -1;
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0 ||
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+	close(fd);
+	return -1;
+    }
+    *done = (connect(fd, p->ai_addr, p->ai_addrlen) == 0);
+    if (!*done && errno != EINPROGRESS) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
 /*
  * open_clientfd - Open connection to server at <hostname, port> and
  *     return a socket descriptor ready for reading and writing. This
@@ -948,8 +1870,31 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
  */
 /* $begin open_clientfd */
 int open_clientfd(char *hostname, char *port) {
-    int clientfd, rc;
-    struct addrinfo hints, *listp, *p;
+    return open_clientfd_timeout(hostname, port, -1);
+}
+/* $end open_clientfd */
+
+/*
+ * open_clientfd_timeout - open_clientfd that spends at most timeout_ms
+ *     milliseconds connecting (no limit if negative), racing the
+ *     server's addresses as described above. The descriptor returned
+ *     is in blocking mode.
+ *
+ *     On error, returns:
+ *       -2 for getaddrinfo error
+ *       -1 with errno set for other errors, ETIMEDOUT if time ran out.
+ */
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms)
+{
+    struct addrinfo hints, *listp, *v[HE_MAXADDRS];
+    struct pollfd pfd[HE_MAXADDRS];
+    int who[HE_MAXADDRS];     /* Index in v of each pending attempt */
+    int n, next = 0, npend = 0, clientfd = -1, win = -1;
+    int rc, i, done, err, saved = ECONNREFUSED;
+    socklen_t len = sizeof(err);
+    long long now, deadline = now_ms() + timeout_ms, last = 0, wait;
+    char key[HE_KEYSIZE];
+    he_entry_t *e;
 
     /* Get a list of potential server addresses */
     memset(&hints, 0, sizeof(struct addrinfo));
@@ -960,30 +1905,90 @@ int open_clientfd(char *hostname, char *port) {
         fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
         return -2;
     }
-  
-    /* Walk the list for one that we can successfully connect to */
-    for (p = listp; p; p = p->ai_next) {
-        /* Create a socket descriptor */
-        if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0) 
-            continue; /* Socket failed, try the next */
+    e = he_slot(key, hostname, port);
+    n = he_order(listp, e, key, v);
+
+    while (win < 0) {
+	now = now_ms();
+	if (timeout_ms >= 0 && now >= deadline) {
+	    timed_out(&ntimeouts.connect);
+	    saved = ETIMEDOUT;
+	    break;
+	}
 
-        /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1) 
-            break; /* Success */
-        if (close(clientfd) < 0) { /* Connect failed, try another */  //line:netp:openclientfd:closefd
-            fprintf(stderr, "open_clientfd: close failed: %s\n", strerror(errno));
-            return -1;
-        } 
-    } 
+	/* Start the next attempt if the last one has had its head start */
+	if (next < n && (npend == 0 || now - last >= HE_DELAY_MS)) {
+	    if ((clientfd = he_start(v[next], &done)) < 0)
+		saved = errno;    /* Failed at once: go on to the next */
+	    else if (done)
+		win = next;
+	    else {
+		pfd[npend].fd = clientfd;
+		pfd[npend].events = POLLOUT;
+		who[npend++] = next;
+		last = now;
+	    }
+	    next++;
+	    continue;
+	}
+	if (npend == 0)
+	    break;                /* Every address failed */
+
+	/* Wait for a pending attempt, the next start or the deadline */
+	wait = (next < n) ? last + HE_DELAY_MS - now : -1;
+	if (timeout_ms >= 0 && (wait < 0 || deadline - now < wait))
+	    wait = deadline - now;
+	if ((rc = poll(pfd, npend, wait)) < 0) {
+	    if (errno == EINTR)
+		continue;
+	    saved = errno;
+	    break;
+	}
+	for (i = 0; rc > 0 && i < npend && win < 0; i++) {
+	    if (pfd[i].revents == 0)
+		continue;
+	    if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+		err == 0) {
+		win = who[i];
+		clientfd = pfd[i].fd;
+		pfd[i].fd = -1;
+		break;
+	    }
+	    saved = err;          /* This one failed; drop it and */
+	    last = 0;             /*   start the next one now */
+	    close(pfd[i].fd);
+	    pfd[i] = pfd[--npend];
+	    who[i--] = who[npend];
+	}
+    }
 
-    /* Clean up */
+    /* Clean up the attempts that lost */
+    for (i = 0; i < npend; i++)
+	if (pfd[i].fd >= 0)
+	    close(pfd[i].fd);
+    if (win >= 0) {
+	fcntl(clientfd, F_SETFL, fcntl(clientfd, F_GETFL, 0) & ~O_NONBLOCK);
+	he_remember(e, key, v[win]);
+    }
     freeaddrinfo(listp);
-    if (!p) /* All connects failed */
-        return -1;
-    else    /* The last connect succeeded */
-        return clientfd;
+    if (win < 0) {
+	errno = saved;
+	return -1;
+    }
+    return clientfd;
+}
+
+/*
+ * timeout_counts - report how many connects, reads and writes have
+ *     failed with ETIMEDOUT since the program started
+ */
+void timeout_counts(unsigned long *nconnect, unsigned long *nread,
+		    unsigned long *nwrite)
+{
+    *nconnect = __atomic_load_n(&ntimeouts.connect, __ATOMIC_RELAXED);
+    *nread = __atomic_load_n(&ntimeouts.read, __ATOMIC_RELAXED);
+    *nwrite = __atomic_load_n(&ntimeouts.write, __ATOMIC_RELAXED);
 }
-/* $end open_clientfd */
 
 /*  
  * open_listenfd - Open and return a listening socket on port. This
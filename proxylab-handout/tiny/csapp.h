@@ -20,6 +20,8 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <errno.h>
 #include <math.h>
 #include <pthread.h>
@@ -43,14 +45,59 @@ typedef struct sockaddr SA;
 /* Persistent state for the robust I/O (Rio) package */
 /* $begin rio_t */
 #define RIO_BUFSIZE 8192
+#define RIO_MAXBUFSIZE (1 << 20) /* rio_peeklineb grows the buffer up to this */
 typedef struct {
     int rio_fd;                /* Descriptor for this internal buf */
     int rio_cnt;               /* Unread bytes in internal buf */
     char *rio_bufptr;          /* Next unread byte in internal buf */
-    char rio_buf[RIO_BUFSIZE]; /* Internal buffer */
+    char *rio_bufbase;         /* Internal buf: rio_buf or a heap buffer */
+    size_t rio_bufsize;        /* Size of the internal buf */
+    int rio_timeout;           /* Per-read timeout in ms, 0 for none */
+    long long rio_deadline;    /* Monotonic ms all reads must end by */
+    char rio_buf[RIO_BUFSIZE]; /* Default internal buffer */
 } rio_t;
 /* $end rio_t */
 
+/* Queue of buffers for writev, resumable after a partial write */
+#define RIO_WQMAX 64
+typedef struct {
+    struct iovec wq_iov[RIO_WQMAX]; /* Fragments, some already written */
+    int wq_head;               /* First fragment not fully written */
+    int wq_cnt;                /* Fragments not fully written */
+    size_t wq_pending;         /* Bytes not yet written */
+} rio_wq_t;
+
+/* An HTTP response being put together for one writev */
+#define RESP_BUFSIZE 8192
+typedef struct {
+    rio_wq_t resp_wq;          /* Fragments, in the order they go out */
+    size_t resp_len;           /* Bytes of resp_buf in use */
+    char resp_buf[RESP_BUFSIZE]; /* Text formatted by resp_printf */
+} resp_t;
+
+/* Bounded multi-producer/multi-consumer queue of pointers */
+#define MPMC_SPINS 1000        /* Default tries before a waiter sleeps */
+typedef struct {
+    size_t seq;                /* Position this cell is ready for */
+    void *item;
+} mpmc_cell_t;
+
+typedef struct {
+    mpmc_cell_t *cells;
+    size_t mask;               /* Number of cells - 1 */
+    int spins;                 /* Tries before put/get sleep */
+    char pad1[64];             /* Keep the indices on their own lines */
+    size_t head;               /* Next position to put into */
+    char pad2[64];
+    size_t tail;               /* Next position to get from */
+    char pad3[64];
+    int nget_waiting;          /* Sleepers, so the other side knows */
+    int nput_waiting;          /*   whether to signal */
+    pthread_mutex_t lock;      /* Only taken to sleep or wake */
+    pthread_cond_t notempty;
+    pthread_cond_t notfull;
+} mpmc_t;
+
 /* External variables */
 extern int h_errno;    /* Defined by BIND for DNS errors */ 
 extern char **environ; /* Defined by libc */
@@ -172,12 +219,39 @@ void Sem_init(sem_t *sem, int pshared, unsigned int value);
 void P(sem_t *sem);
 void V(sem_t *sem);
 
+/* Bounded MPMC queue */
+int mpmc_init(mpmc_t *q, size_t n, int spins);
+void mpmc_deinit(mpmc_t *q);
+int mpmc_tryput(mpmc_t *q, void *item);
+int mpmc_tryget(mpmc_t *q, void **itemp);
+void mpmc_put(mpmc_t *q, void *item);
+void *mpmc_get(mpmc_t *q);
+int mpmc_timedput(mpmc_t *q, void *item, int timeout_ms);
+int mpmc_timedget(mpmc_t *q, void **itemp, int timeout_ms);
+
 /* Rio (Robust I/O) package */
 ssize_t rio_readn(int fd, void *usrbuf, size_t n);
 ssize_t rio_writen(int fd, void *usrbuf, size_t n);
 void rio_readinitb(rio_t *rp, int fd); 
 ssize_t	rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t	rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+int rio_resizeb(rio_t *rp, size_t size);
+void rio_freeb(rio_t *rp);
+ssize_t rio_peekb(rio_t *rp, char **bufp, size_t n);
+ssize_t rio_peeklineb(rio_t *rp, char **linep);
+void rio_consumeb(rio_t *rp, size_t n);
+int rio_settimeout(rio_t *rp, int read_ms, int write_ms);
+void rio_setdeadline(rio_t *rp, int ms);
+ssize_t rio_tryreadnb(rio_t *rp, void *usrbuf, size_t n);
+ssize_t rio_tryreadlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+void rio_wqinit(rio_wq_t *wq);
+int rio_wqpush(rio_wq_t *wq, void *buf, size_t n);
+ssize_t rio_wqflush(int fd, rio_wq_t *wq);
+void resp_init(resp_t *rb);
+int resp_printf(resp_t *rb, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int resp_addb(resp_t *rb, void *buf, size_t n);
+int resp_flush(int fd, resp_t *rb, int more);
 
 /* Wrappers for Rio package */
 ssize_t Rio_readn(int fd, void *usrbuf, size_t n);
@@ -185,9 +259,16 @@ void Rio_writen(int fd, void *usrbuf, size_t n);
 void Rio_readinitb(rio_t *rp, int fd); 
 ssize_t Rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_peekb(rio_t *rp, char **bufp, size_t n);
+ssize_t Rio_peeklineb(rio_t *rp, char **linep);
+ssize_t Rio_wqflush(int fd, rio_wq_t *wq);
+void Resp_flush(int fd, resp_t *rb, int more);
 
 /* Reentrant protocol-independent client/server helpers */
 int open_clientfd(char *hostname, char *port);
+int open_clientfd_timeout(char *hostname, char *port, int timeout_ms);
+void timeout_counts(unsigned long *nconnect, unsigned long *nread,
+		    unsigned long *nwrite);
 int open_listenfd(char *port);
 
 /* Wrappers for reentrant protocol-independent client/server helpers */
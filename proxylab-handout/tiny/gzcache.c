@@ -0,0 +1,153 @@
+/*
+ * gzcache.c - in-memory cache of gzip-compressed static files
+ *
+ * Files are compressed the first time a gzip-capable client asks for
+ * them. An entry is keyed by file name and remembers the version
+ * (device, inode, size, mtime) it was built from, so an edited file
+ * is recompressed on its next request. Entries are evicted least
+ * recently used first once GZCACHE_MAX_SIZE is exceeded. Tiny is
+ * iterative, so the cache needs no locking.
+ */
+#include <zlib.h>
+#include "gzcache.h"
+
+static GzEntry *find_entry(GzCache *cache, char *filename);
+static void free_entry(GzCache *cache, GzEntry *e);
+static char *compress_file(char *filename, size_t filesize, size_t *len);
+
+void gzcache_init(GzCache *cache) 
+{
+    cache->head = NULL;
+    cache->size = 0;
+}
+
+/*
+ * gzcache_get - return the gzip encoding of filename as of sbuf and set
+ *     *len to its length. Returns NULL if the file is outside the size
+ *     limits or doesn't get smaller when compressed; the caller then
+ *     sends it as it is.
+ */
+char *gzcache_get(GzCache *cache, char *filename, struct stat *sbuf, 
+                  size_t *len) 
+{
+    GzEntry *e;
+
+    if (sbuf->st_size < GZIP_MIN_SIZE || sbuf->st_size > GZIP_MAX_SIZE)
+        return NULL;
+
+    if ((e = find_entry(cache, filename)) != NULL) {
+        if (e->dev == sbuf->st_dev && e->ino == sbuf->st_ino &&
+            e->size == sbuf->st_size &&
+            e->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+            e->mtime.tv_nsec == sbuf->st_mtim.tv_nsec) {
+            *len = e->len;
+            return e->data;
+        }
+        free_entry(cache, e);   /* Stale version */
+    }
+
+    e = Malloc(sizeof(GzEntry));
+    e->filename = Malloc(strlen(filename) + 1);
+    strcpy(e->filename, filename);
+    e->dev = sbuf->st_dev;
+    e->ino = sbuf->st_ino;
+    e->size = sbuf->st_size;
+    e->mtime = sbuf->st_mtim;
+    e->data = compress_file(filename, sbuf->st_size, &e->len);
+
+    /* Make room, then insert at the head */
+    cache->size += e->len;
+    while (cache->size > GZCACHE_MAX_SIZE && cache->head != NULL) {
+        GzEntry *lru = cache->head;
+        while (lru->next != NULL)
+            lru = lru->next;
+        free_entry(cache, lru);
+    }
+    e->prev = NULL;
+    e->next = cache->head;
+    if (cache->head != NULL)
+        cache->head->prev = e;
+    cache->head = e;
+
+    *len = e->len;
+    return e->data;
+}
+
+/* find_entry - look up filename and move its entry to the head */
+static GzEntry *find_entry(GzCache *cache, char *filename) 
+{
+    GzEntry *e;
+
+    for (e = cache->head; e != NULL; e = e->next)
+        if (!strcmp(e->filename, filename))
+            break;
+    if (e == NULL || e == cache->head)
+        return e;
+
+    e->prev->next = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    e->prev = NULL;
+    e->next = cache->head;
+    cache->head->prev = e;
+    cache->head = e;
+    return e;
+}
+
+static void free_entry(GzCache *cache, GzEntry *e) 
+{
+    if (e->prev != NULL)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+    if (e->next != NULL)
+        e->next->prev = e->prev;
+    cache->size -= e->len;
+    free(e->filename);
+    free(e->data);
+    free(e);
+}
+
+/*
+ * compress_file - gzip the file into a malloc'd buffer. Returns NULL
+ *     (with *len 0) if the file can't be read or wouldn't shrink.
+ */
+static char *compress_file(char *filename, size_t filesize, size_t *len) 
+{
+    int srcfd;
+    char *srcp, *out;
+    uLong bound;
+    z_stream zs;
+
+    *len = 0;
+    if ((srcfd = open(filename, O_RDONLY, 0)) < 0)
+        return NULL;
+    srcp = mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0);
+    Close(srcfd);
+    if (srcp == MAP_FAILED)
+        return NULL;
+
+    memset(&zs, 0, sizeof(zs));
+    /* windowBits 15 + 16 selects the gzip wrapper */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        Munmap(srcp, filesize);
+        return NULL;
+    }
+    bound = deflateBound(&zs, filesize);
+    out = Malloc(bound);
+    zs.next_in = (Bytef *)srcp;
+    zs.avail_in = filesize;
+    zs.next_out = (Bytef *)out;
+    zs.avail_out = bound;
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out >= filesize) {
+        deflateEnd(&zs);
+        Munmap(srcp, filesize);
+        free(out);
+        return NULL;
+    }
+    *len = zs.total_out;
+    deflateEnd(&zs);
+    Munmap(srcp, filesize);
+    return Realloc(out, *len);
+}
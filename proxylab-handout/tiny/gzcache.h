@@ -0,0 +1,36 @@
+/*
+ * gzcache.h - in-memory cache of gzip-compressed static files
+ */
+#ifndef __GZCACHE_H__
+#define __GZCACHE_H__
+
+#include "csapp.h"
+
+#define GZCACHE_MAX_SIZE (4 << 20) /* Total compressed bytes kept */
+#define GZIP_MIN_SIZE    256       /* Smaller files aren't worth it */
+#define GZIP_MAX_SIZE    (1 << 20) /* Larger files are sent as they are */
+
+/* A compressed file, valid while the file keeps the same version */
+typedef struct gzentry {
+    char *filename;
+    dev_t dev;                /* Version: inode, size and mtime */
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    char *data;               /* gzip stream, NULL if it didn't shrink */
+    size_t len;
+    struct gzentry *next;
+    struct gzentry *prev;
+} GzEntry;
+
+typedef struct {
+    GzEntry *head;            /* Most recently used first */
+    size_t size;              /* Sum of len over all entries */
+} GzCache;
+
+void gzcache_init(GzCache *cache);
+
+char *gzcache_get(GzCache *cache, char *filename, struct stat *sbuf, 
+                  size_t *len);
+
+#endif
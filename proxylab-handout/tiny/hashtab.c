@@ -0,0 +1,89 @@
+/*
+ * hashtab.c - open-addressing hash table keyed by case-insensitive strings
+ *
+ * Keys are hashed with FNV-1a over their lower-cased bytes and probed
+ * linearly. The table doubles before it gets half full, so a lookup
+ * touches one or two slots on average. Lookups take a (pointer, length)
+ * pair, so callers can look up a slice of a larger string, such as a
+ * file name extension, without copying it first.
+ */
+#include "hashtab.h"
+
+#define HASHTAB_MIN_CAP 16
+
+static size_t hash_key(const char *key, size_t len);
+static HashEntry *find_slot(HashTab *tab, const char *key, size_t len);
+
+void hashtab_init(HashTab *tab) 
+{
+    tab->cap = HASHTAB_MIN_CAP;
+    tab->n = 0;
+    tab->slots = Calloc(tab->cap, sizeof(HashEntry));
+}
+
+/*
+ * hashtab_put - map key to val, replacing an earlier mapping
+ */
+void hashtab_put(HashTab *tab, const char *key, size_t len, void *val) 
+{
+    HashEntry *e;
+    size_t i;
+
+    if (2 * (tab->n + 1) > tab->cap) {  /* Grow and rehash */
+        HashEntry *old = tab->slots;
+        size_t oldcap = tab->cap;
+
+        tab->cap *= 2;
+        tab->slots = Calloc(tab->cap, sizeof(HashEntry));
+        for (i = 0; i < oldcap; i++)
+            if (old[i].key != NULL)
+                *find_slot(tab, old[i].key, old[i].len) = old[i];
+        free(old);
+    }
+
+    e = find_slot(tab, key, len);
+    if (e->key == NULL) {
+        e->key = Malloc(len + 1);
+        for (i = 0; i < len; i++)
+            e->key[i] = tolower((unsigned char)key[i]);
+        e->key[len] = '\0';
+        e->len = len;
+        tab->n++;
+    }
+    e->val = val;
+}
+
+/*
+ * hashtab_get - return the value mapped to key, NULL if there is none
+ */
+void *hashtab_get(HashTab *tab, const char *key, size_t len) 
+{
+    return find_slot(tab, key, len)->val;
+}
+
+/* hash_key - FNV-1a over the lower-cased key */
+static size_t hash_key(const char *key, size_t len) 
+{
+    size_t h = 2166136261u;
+
+    while (len-- > 0) {
+        h ^= (unsigned char)tolower((unsigned char)*key++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* find_slot - return the slot holding key, or the empty slot it goes in */
+static HashEntry *find_slot(HashTab *tab, const char *key, size_t len) 
+{
+    size_t mask = tab->cap - 1;
+    size_t i = hash_key(key, len) & mask;
+
+    while (tab->slots[i].key != NULL) {
+        if (tab->slots[i].len == len && 
+            !strncasecmp(tab->slots[i].key, key, len))
+            break;
+        i = (i + 1) & mask;
+    }
+    return &tab->slots[i];
+}
@@ -0,0 +1,27 @@
+/*
+ * hashtab.h - open-addressing hash table keyed by case-insensitive strings
+ */
+#ifndef __HASHTAB_H__
+#define __HASHTAB_H__
+
+#include "csapp.h"
+
+typedef struct {
+    char *key;                /* Lower-cased copy, NULL if slot empty */
+    size_t len;
+    void *val;
+} HashEntry;
+
+typedef struct {
+    HashEntry *slots;
+    size_t cap;               /* Power of two, kept at least 2 * n */
+    size_t n;
+} HashTab;
+
+void hashtab_init(HashTab *tab);
+
+void hashtab_put(HashTab *tab, const char *key, size_t len, void *val);
+
+void *hashtab_get(HashTab *tab, const char *key, size_t len);
+
+#endif
@@ -1,118 +1,464 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the 
+ * tiny.c - A simple, iterative HTTP/1.1 Web server that uses the 
  *     GET method to serve static and dynamic content.
  *
  * Updated 11/2019 droh 
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *
+ * Updated: persistent connections
+ *   - Connections stay open across requests (HTTP/1.1 default, or
+ *     HTTP/1.0 with "Connection: keep-alive"). Pipelined requests are
+ *     served in order out of the same per-connection Rio buffer.
+ *   - Every response carries a Content-length, except CGI output
+ *     without one, which is sent chunked to HTTP/1.1 clients.
+ *   - Idle connections are closed after KEEPALIVE_TIMEOUT seconds,
+ *     and a client gets REQUEST_TIMEOUT seconds to send each request
+ *     line and its headers, so a stalled client can't hold up the
+ *     iterative server.
+ *   - A client that goes away, even with pipelined requests still
+ *     queued, only ends its own connection: SIGPIPE is ignored and
+ *     failed reads and writes on the connection close it.
+ *
+ * Updated: content encoding
+ *   - A static file with a foo.br or foo.gz sibling that is at least as
+ *     new as foo is served from the sibling when the client accepts
+ *     that encoding.
+ *   - Built with TINY_GZIP, compressible files without a sibling are
+ *     gzipped on the fly; the result is cached per file version.
+ *
+ * Updated: table-driven dispatch
+ *   - MIME types come from a hash table keyed by the file name
+ *     extension, loaded from ./mime.types, so foo.html.bak is no
+ *     longer taken for HTML.
+ *   - Static vs. dynamic content is decided by looking the first path
+ *     segment up in a route table instead of searching for "cgi-bin".
+ *
+ * Updated: access log
+ *   - Requests are recorded in Common Log Format by the asynchronous
+ *     access log instead of being printed to stdout as they are read.
+ *
+ * Updated: validators and directory listings
+ *   - Static responses carry a strong ETag built from the inode, mtime
+ *     and size of the file sent, and a Last-Modified date. Requests
+ *     whose If-None-Match (or, failing that, If-Modified-Since) still
+ *     matches get a 304 with no body.
+ *   - A URI ending in '/' whose directory has no home.html gets a
+ *     generated listing, cached until the directory changes.
+ *
+ * Updated: io_uring
+ *   - Built with TINY_URING, static files that fit in a 64K buffer are
+ *     opened, read, written and closed with one io_uring_enter call.
+ *     Kernels without io_uring get the mmap/write path.
+ *
+ * Updated: one writev per response
+ *   - Header lines and body buffers are gathered in a resp_t and sent
+ *     together, so a static file, listing or error page costs one
+ *     system call instead of one per header line.
  */
+#include <poll.h>
 #include "csapp.h"
+#include "hashtab.h"
+#include "accesslog.h"
+#ifdef TINY_GZIP
+#include "gzcache.h"
+#endif
+#ifdef TINY_URING
+#include "uring.h"
+#endif
+
+#define KEEPALIVE_TIMEOUT 5   /* Seconds to wait for the next request */
+#define KEEPALIVE_MAX     100 /* Max requests served on one connection */
+#define REQUEST_TIMEOUT   10  /* Seconds to read one whole request */
+
+/* Per-request state derived from the request line and headers */
+typedef struct {
+    int http11;       /* Client spoke HTTP/1.1 */
+    int keep_alive;   /* Connection persists after this response */
+    int accept_gzip;  /* Accept-Encoding allows gzip */
+    int accept_br;    /* Accept-Encoding allows br */
+    char if_none_match[MAXLINE]; /* Empty if absent */
+    time_t if_modified_since;    /* -1 if absent or malformed */
+    char request[MAXLINE]; /* Request line, for the access log */
+    int status;       /* Response status and body size, set by */
+    long bytes;       /*   the function that sends the response */
+} reqhdrs_t;
+
+/* A route maps the first segment of a URI path to a kind of content */
+typedef struct {
+    char *segment;
+    int is_static;
+} route_t;
+
+#define MIMETYPES_FILE "./mime.types"
+#define DEFAULT_TYPE   "text/plain" /* Type of files with unknown extension */
+
+static route_t routes[] = {
+    { "cgi-bin", 0 },
+};
+
+/* Used when MIMETYPES_FILE is missing */
+static char *builtin_types[][2] = {
+    { "html", "text/html" },
+    { "css",  "text/css" },
+    { "js",   "application/javascript" },
+    { "gif",  "image/gif" },
+    { "png",  "image/png" },
+    { "jpg",  "image/jpeg" },
+};
 
-void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+/* A rendered directory listing and the directory version it shows */
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    char *html;
+    size_t len;
+} dirlist_t;
+
+static HashTab mimetab;  /* Extension -> MIME type */
+static HashTab routetab; /* First path segment -> route_t */
+static HashTab dirtab;   /* Directory name -> dirlist_t */
+
+#ifdef TINY_GZIP
+static GzCache gzcache;  /* On-the-fly gzip results */
+#endif
+
+#ifdef TINY_URING
+#define URING_ENTRIES 8          /* One batch is four operations */
+#define URING_BUFSIZE (64 * 1024) /* Largest file sent through the ring */
+
+static Uring ring;       /* fd is -1 when the kernel can't be used */
+static char *ringbuf;    /* Registered buffer 0 */
+#endif
+
+void serve_conn(int fd, char *client);
+int wait_request(rio_t *rp, int timeout);
+int doit(int fd, rio_t *rp, reqhdrs_t *rq, int last);
+int read_requesthdrs(rio_t *rp, reqhdrs_t *rq);
+int accepts_encoding(char *val, char *coding);
+void init_tables(char *mimefile);
+int load_mimetypes(char *mimefile);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, reqhdrs_t *rq);
+void make_etag(struct stat *sbuf, char *suffix, char *etag);
+int not_modified(reqhdrs_t *rq, char *etag, time_t mtime);
+void serve_not_modified(int fd, char *etag, time_t mtime, int vary, 
+			reqhdrs_t *rq);
+void format_httpdate(time_t t, char *buf);
+time_t parse_httpdate(char *s);
+void serve_dirlist(int fd, char *dirname, char *uri, struct stat *sbuf, 
+		   reqhdrs_t *rq);
+dirlist_t *get_dirlist(char *dirname, char *uri, struct stat *sbuf);
+int cmpname(const void *a, const void *b);
+void append(char **buf, size_t *len, size_t *cap, char *s);
+void append_html(char **buf, size_t *len, size_t *cap, char *s);
+void append_url(char **buf, size_t *len, size_t *cap, char *s);
+int find_precompressed(char *filename, char *ext, struct stat *sbuf,
+		       char *zfilename, struct stat *zsbuf);
 void get_filetype(char *filename, char *filetype);
-void serve_dynamic(int fd, char *filename, char *cgiargs);
+int is_compressible(char *filetype);
+int serve_dynamic(int fd, char *filename, char *cgiargs, reqhdrs_t *rq);
+#ifdef TINY_URING
+void init_uring(void);
+int send_file_uring(int fd, char *filename, size_t filesize);
+#endif
 void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg);
+		 char *shortmsg, char *longmsg, reqhdrs_t *rq);
 
 int main(int argc, char **argv) 
 {
     int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
+    char hostname[MAXLINE], port[MAXLINE], client[2 * MAXLINE];
     socklen_t clientlen;
     struct sockaddr_storage clientaddr;
 
     /* Check command line args */
-    if (argc != 2) {
-	fprintf(stderr, "usage: %s <port>\n", argv[0]);
+    if (argc != 2 && argc != 3) {
+	fprintf(stderr, "usage: %s <port> [access log]\n", argv[0]);
 	exit(1);
     }
 
+    if (alog_init(argc == 3 ? argv[2] : NULL, ALOG_FLUSH_MS, 
+		  ALOG_ROTATE_SIZE) < 0)
+	unix_error("Access log open error");
+
+    Signal(SIGPIPE, SIG_IGN);  /* A closed client fails a write instead */
+    init_tables(MIMETYPES_FILE);
+#ifdef TINY_GZIP
+    gzcache_init(&gzcache);
+#endif
+#ifdef TINY_URING
+    init_uring();
+#endif
     listenfd = Open_listenfd(argv[1]);
     while (1) {
 	clientlen = sizeof(clientaddr);
 	connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); //line:netp:tiny:accept
         Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
                     port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-	doit(connfd);                                             //line:netp:tiny:doit
+        alog_printf("Accepted connection from (%s, %s)", hostname, port);
+	sprintf(client, "%s:%s", hostname, port);
+	serve_conn(connfd, client);                               //line:netp:tiny:doit
 	Close(connfd);                                            //line:netp:tiny:close
     }
 }
 /* $end tinymain */
 
 /*
- * doit - handle one HTTP request/response transaction
+ * serve_conn - serve requests on a connection until the client asks
+ *     to close it, goes idle, or hits KEEPALIVE_MAX. The Rio buffer is
+ *     initialized once, so pipelined requests that arrived together
+ *     with an earlier one are picked up from it without another read.
+ *     Reading each request is bounded by a REQUEST_TIMEOUT deadline.
+ */
+void serve_conn(int fd, char *client)
+{
+    int nreq, keep;
+    rio_t rio;
+    reqhdrs_t rq;
+
+    Rio_readinitb(&rio, fd);
+    for (nreq = 1; nreq <= KEEPALIVE_MAX; nreq++) {
+	if (nreq > 1 && !wait_request(&rio, KEEPALIVE_TIMEOUT))
+	    break;
+	rio_setdeadline(&rio, REQUEST_TIMEOUT * 1000);
+	keep = doit(fd, &rio, &rq, nreq == KEEPALIVE_MAX);
+	if (rq.status != 0)
+	    alog_access(client, rq.request, rq.status, rq.bytes);
+	if (!keep)
+	    break;
+    }
+}
+
+/*
+ * wait_request - wait up to timeout seconds for the next request.
+ *     Returns 1 if request bytes are buffered or readable, 0 if the
+ *     connection went idle.
+ */
+int wait_request(rio_t *rp, int timeout)
+{
+    struct pollfd pfd;
+    int rc;
+
+    if (rp->rio_cnt > 0)  /* Pipelined request already buffered */
+	return 1;
+    pfd.fd = rp->rio_fd;
+    pfd.events = POLLIN;
+    while ((rc = poll(&pfd, 1, timeout * 1000)) < 0 && errno == EINTR)
+	;
+    return rc > 0;
+}
+
+/*
+ * doit - handle one HTTP request/response transaction. Returns 1 if
+ *     the connection can carry another request, 0 if it must be closed,
+ *     including when reading from or writing to the client failed.
+ *     last is set on the final request allowed on this connection.
  */
 /* $begin doit */
-void doit(int fd) 
+int doit(int fd, rio_t *rp, reqhdrs_t *rq, int last) 
 {
     int is_static;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
     char filename[MAXLINE], cgiargs[MAXLINE];
-    rio_t rio;
 
     /* Read request line and headers */
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb(&rio, buf, MAXLINE))  //line:netp:doit:readrequest
-        return;
-    printf("%s", buf);
-    sscanf(buf, "%s %s %s", method, uri, version);       //line:netp:doit:parserequest
+    memset(rq, 0, sizeof(*rq));
+    if (rio_readlineb(rp, buf, MAXLINE) <= 0)  //line:netp:doit:readrequest
+        return 0;
+    strcpy(rq->request, buf);
+    if (sscanf(buf, "%s %s %s", method, uri, version) != 3) { //line:netp:doit:parserequest
+        clienterror(fd, buf, "400", "Bad Request",
+                    "Tiny couldn't parse the request", rq);
+        return 0;
+    }
+    rq->http11 = !strcasecmp(version, "HTTP/1.1");
     if (strcasecmp(method, "GET")) {                     //line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
-        return;
+                    "Tiny does not implement this method", rq);
+        return 0;
     }                                                    //line:netp:doit:endrequesterr
-    read_requesthdrs(&rio);                              //line:netp:doit:readrequesthdrs
+    if (read_requesthdrs(rp, rq) < 0)                   //line:netp:doit:readrequesthdrs
+        return 0;
+    if (last)
+        rq->keep_alive = 0;
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs);       //line:netp:doit:staticcheck
     if (stat(filename, &sbuf) < 0) {                     //line:netp:doit:beginnotfound
+	/* No home.html: list the directory instead */
+	if (is_static && uri[strlen(uri)-1] == '/') {
+	    filename[strlen(filename) - strlen("home.html")] = '\0';
+	    if (stat(filename, &sbuf) == 0 && S_ISDIR(sbuf.st_mode)) {
+		serve_dirlist(fd, filename, uri, &sbuf, rq);
+		return rq->keep_alive;
+	    }
+	}
 	clienterror(fd, filename, "404", "Not found",
-		    "Tiny couldn't find this file");
-	return;
+		    "Tiny couldn't find this file", rq);
+	return rq->keep_alive;
     }                                                    //line:netp:doit:endnotfound
 
     if (is_static) { /* Serve static content */          
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode)) { //line:netp:doit:readable
 	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't read the file");
-	    return;
+			"Tiny couldn't read the file", rq);
+	    return rq->keep_alive;
 	}
-	serve_static(fd, filename, sbuf.st_size);        //line:netp:doit:servestatic
+	serve_static(fd, filename, &sbuf, rq);          //line:netp:doit:servestatic
+	return rq->keep_alive;
     }
     else { /* Serve dynamic content */
 	if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode)) { //line:netp:doit:executable
 	    clienterror(fd, filename, "403", "Forbidden",
-			"Tiny couldn't run the CGI program");
-	    return;
+			"Tiny couldn't run the CGI program", rq);
+	    return rq->keep_alive;
 	}
-	serve_dynamic(fd, filename, cgiargs);            //line:netp:doit:servedynamic
+	return serve_dynamic(fd, filename, cgiargs, rq); //line:netp:doit:servedynamic
     }
 }
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers and record the ones
+ *     that decide whether the connection persists. A request body
+ *     announced by Content-length is discarded so that the next
+ *     pipelined request starts at the right byte. Returns -1 if the
+ *     client closed the connection in the middle of the headers or the
+ *     read failed.
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp) 
+int read_requesthdrs(rio_t *rp, reqhdrs_t *rq) 
 {
-    char buf[MAXLINE];
+    char buf[MAXLINE], *val, *p;
+    long bodylen = 0;
+    ssize_t n;
+
+    rq->keep_alive = rq->http11;
+    rq->if_none_match[0] = '\0';
+    rq->if_modified_since = -1;
+    do {
+	if (rio_readlineb(rp, buf, MAXLINE) <= 0)
+	    return -1;
+	if ((val = strchr(buf, ':')) == NULL)
+	    continue;
+	val++;
+	if (!strncasecmp(buf, "Connection:", 11)) {
+	    for (p = val; *p; p++)
+		*p = tolower(*p);
+	    if (strstr(val, "close"))
+		rq->keep_alive = 0;
+	    else if (strstr(val, "keep-alive"))
+		rq->keep_alive = 1;
+	}
+	else if (!strncasecmp(buf, "Content-length:", 15))
+	    bodylen = atol(val);
+	else if (!strncasecmp(buf, "If-None-Match:", 14)) {
+	    val += strspn(val, " \t");
+	    val[strcspn(val, "\r\n")] = '\0';
+	    strcpy(rq->if_none_match, val);
+	}
+	else if (!strncasecmp(buf, "If-Modified-Since:", 18))
+	    rq->if_modified_since = parse_httpdate(val);
+	else if (!strncasecmp(buf, "Accept-Encoding:", 16)) {
+	    rq->accept_gzip = accepts_encoding(val, "gzip");
+	    rq->accept_br = accepts_encoding(val, "br");
+	}
+    } while (strcmp(buf, "\r\n"));          //line:netp:readhdrs:checkterm
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while(strcmp(buf, "\r\n")) {          //line:netp:readhdrs:checkterm
-	Rio_readlineb(rp, buf, MAXLINE);
-	printf("%s", buf);
+    /* Skip a request body we don't use */
+    while (bodylen > 0) {
+	n = rio_readnb(rp, buf, bodylen < MAXLINE ? bodylen : MAXLINE);
+	if (n <= 0)
+	    return -1;
+	bodylen -= n;
     }
-    return;
+    return 0;
 }
 /* $end read_requesthdrs */
 
+/*
+ * accepts_encoding - return 1 if the Accept-Encoding value val lists
+ *     coding without a zero q-value
+ */
+int accepts_encoding(char *val, char *coding)
+{
+    size_t len = strlen(coding);
+    char *p = val, *q;
+
+    while (*p) {
+	while (*p == ' ' || *p == '\t' || *p == ',')
+	    p++;
+	if (!strncasecmp(p, coding, len) && strchr(" \t;,\r\n", p[len])) {
+	    q = p + len;
+	    while (*q == ' ' || *q == '\t')
+		q++;
+	    if (*q != ';')
+		return 1;
+	    if ((q = strstr(q, "q=")) == NULL)
+		return 1;
+	    return atof(q + 2) > 0;
+	}
+	if ((p = strchr(p, ',')) == NULL)
+	    break;
+    }
+    return 0;
+}
+
+/*
+ * init_tables - build the route table and the MIME type table
+ */
+void init_tables(char *mimefile)
+{
+    int i;
+
+    hashtab_init(&routetab);
+    for (i = 0; i < sizeof(routes) / sizeof(routes[0]); i++)
+	hashtab_put(&routetab, routes[i].segment, strlen(routes[i].segment),
+		    &routes[i]);
+
+    hashtab_init(&dirtab);
+    hashtab_init(&mimetab);
+    if (load_mimetypes(mimefile) < 0) {
+	fprintf(stderr, "%s: %s, using built-in types\n", 
+		mimefile, strerror(errno));
+	for (i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++)
+	    hashtab_put(&mimetab, builtin_types[i][0], 
+			strlen(builtin_types[i][0]), builtin_types[i][1]);
+    }
+}
+
+/*
+ * load_mimetypes - add the entries of a mime.types style file, one
+ *     "type ext ext ..." per line, to the MIME type table. Returns -1
+ *     if the file can't be opened.
+ */
+int load_mimetypes(char *mimefile)
+{
+    FILE *fp;
+    char line[MAXLINE], *type, *ext, *saveptr, *copy;
+
+    if ((fp = fopen(mimefile, "r")) == NULL)
+	return -1;
+    while (Fgets(line, MAXLINE, fp) != NULL) {
+	if ((type = strtok_r(line, " \t\r\n", &saveptr)) == NULL || 
+	    type[0] == '#')
+	    continue;
+	copy = NULL;
+	while ((ext = strtok_r(NULL, " \t\r\n", &saveptr)) != NULL) {
+	    if (copy == NULL) {
+		copy = Malloc(strlen(type) + 1);
+		strcpy(copy, type);
+	    }
+	    hashtab_put(&mimetab, ext, strlen(ext), copy);
+	}
+    }
+    Fclose(fp);
+    return 0;
+}
+
 /*
  * parse_uri - parse URI into filename and CGI args
  *             return 0 if dynamic content, 1 if static
@@ -120,9 +466,12 @@ void read_requesthdrs(rio_t *rp)
 /* $begin parse_uri */
 int parse_uri(char *uri, char *filename, char *cgiargs) 
 {
-    char *ptr;
+    char *ptr, *seg = uri + (uri[0] == '/');
+    route_t *route;
 
-    if (!strstr(uri, "cgi-bin")) {  /* Static content */ //line:netp:parseuri:isstatic
+    /* Route on the first path segment */
+    route = hashtab_get(&routetab, seg, strcspn(seg, "/?"));
+    if (route == NULL || route->is_static) {  /* Static content */ //line:netp:parseuri:isstatic
 	strcpy(cgiargs, "");                             //line:netp:parseuri:clearcgi
 	strcpy(filename, ".");                           //line:netp:parseuri:beginconvert1
 	strcat(filename, uri);                           //line:netp:parseuri:endconvert1
@@ -146,72 +495,590 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client 
+ * serve_static - copy a file back to the client, compressed if the
+ *     client accepts an encoding we have the file in. A failed write
+ *     clears rq->keep_alive.
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
+void serve_static(int fd, char *filename, struct stat *sbuf, reqhdrs_t *rq)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    int srcfd, filesize = sbuf->st_size, vary;
+    char *srcp, filetype[MAXLINE];
+    char zfilename[MAXLINE], *encoding = NULL, *zdata = NULL;
+    char etag[64], date[64];
+    struct stat zsbuf;
+    size_t zlen;
+    resp_t rb;
 
-    /* Send response headers to client */
     get_filetype(filename, filetype);    //line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); //line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf));    //line:netp:servestatic:endserve
+    vary = is_compressible(filetype);
+
+    /* Pick the smallest representation the client accepts */
+    if (rq->accept_br && 
+	find_precompressed(filename, ".br", sbuf, zfilename, &zsbuf))
+	encoding = "br";
+    else if (rq->accept_gzip && 
+	     find_precompressed(filename, ".gz", sbuf, zfilename, &zsbuf))
+	encoding = "gzip";
+#ifdef TINY_GZIP
+    else if (rq->accept_gzip && vary &&
+	     (zdata = gzcache_get(&gzcache, filename, sbuf, &zlen)) != NULL) {
+	encoding = "gzip";
+	filesize = zlen;
+    }
+#endif
+    if (encoding != NULL && zdata == NULL) {
+	filename = zfilename;
+	filesize = zsbuf.st_size;
+    }
+
+    /* The tag names the bytes sent: a sibling has its own inode */
+    if (zdata != NULL)
+	make_etag(sbuf, "-gz", etag);
+    else
+	make_etag(encoding ? &zsbuf : sbuf, "", etag);
+    if (not_modified(rq, etag, sbuf->st_mtime)) {
+	serve_not_modified(fd, etag, sbuf->st_mtime, vary || encoding, rq);
+	return;
+    }
+
+    /* Build response headers; they go out together with the body */
+    resp_init(&rb);
+    resp_printf(&rb, "HTTP/1.%d 200 OK\r\n", rq->http11); //line:netp:servestatic:beginserve
+    resp_printf(&rb, "Server: Tiny Web Server\r\n");
+    resp_printf(&rb, "Connection: %s\r\n", rq->keep_alive ? "keep-alive" : "close");
+    if (encoding != NULL)
+	resp_printf(&rb, "Content-Encoding: %s\r\n", encoding);
+    if (vary || encoding != NULL)
+	resp_printf(&rb, "Vary: Accept-Encoding\r\n");
+    format_httpdate(sbuf->st_mtime, date);
+    resp_printf(&rb, "ETag: %s\r\nLast-Modified: %s\r\n", etag, date);
+    resp_printf(&rb, "Content-length: %d\r\n", filesize);
+    resp_printf(&rb, "Content-type: %s\r\n\r\n", filetype); //line:netp:servestatic:endserve
+
+    rq->status = 200;
+    rq->bytes = filesize;
+    if (zdata != NULL)                   /* Cached gzip body */
+	resp_addb(&rb, zdata, zlen);
+    if (zdata != NULL || filesize == 0) { /* mmap rejects empty mappings */
+	if (resp_flush(fd, &rb, 0) < 0)
+	    rq->keep_alive = 0;
+	return;
+    }
+#ifdef TINY_URING
+    if (filesize <= URING_BUFSIZE && ring.fd >= 0) {
+	if (resp_flush(fd, &rb, 1) < 0) { /* Body follows from the ring */
+	    rq->keep_alive = 0;
+	    return;
+	}
+	switch (send_file_uring(fd, filename, filesize)) {
+	case 0:
+	    return;
+	case -2:                         /* The client went away */
+	    rq->keep_alive = 0;
+	    return;
+	}                                /* -1: send it from a mapping */
+    }
+#endif
 
     /* Send response body to client */
     srcfd = Open(filename, O_RDONLY, 0); //line:netp:servestatic:open
     srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); //line:netp:servestatic:mmap
     Close(srcfd);                       //line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);     //line:netp:servestatic:write
+    resp_addb(&rb, srcp, filesize);
+    if (resp_flush(fd, &rb, 0) < 0)     //line:netp:servestatic:write
+	rq->keep_alive = 0;
     Munmap(srcp, filesize);             //line:netp:servestatic:munmap
 }
 
+#ifdef TINY_URING
 /*
- * get_filetype - derive file type from file name
+ * init_uring - set up the ring used by send_file_uring, with one
+ *     registered buffer and one registered file slot. Leaves ring.fd
+ *     at -1, so that files are sent with mmap and write, if the kernel
+ *     lacks io_uring or any operation send_file_uring needs.
  */
-void get_filetype(char *filename, char *filetype) 
+void init_uring(void)
+{
+    static const int ops[] = { IORING_OP_OPENAT, IORING_OP_READ_FIXED,
+			       IORING_OP_WRITE_FIXED, IORING_OP_CLOSE };
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct iovec iov;
+    int slot = -1, res;
+
+    if (uring_init(&ring, URING_ENTRIES) < 0)
+	return;
+    ringbuf = Malloc(URING_BUFSIZE);
+    iov.iov_base = ringbuf;
+    iov.iov_len = URING_BUFSIZE;
+    if (!uring_probe(&ring, ops, sizeof(ops) / sizeof(ops[0])) ||
+	uring_register_buffers(&ring, &iov, 1) < 0 ||
+	uring_register_files(&ring, &slot, 1) < 0)
+	goto fail;
+
+    /* Opening into a file slot needs Linux 5.15; try it once */
+    sqe = uring_get_sqe(&ring);
+    uring_prep_openat(sqe, AT_FDCWD, ".", O_RDONLY, 0, 0);
+    if (uring_submit(&ring, 1) < 0 || uring_wait_cqe(&ring, &cqe) < 0)
+	goto fail;
+    res = cqe->res;
+    uring_cqe_seen(&ring);
+    if (res < 0)
+	goto fail;
+    alog_printf("Sending files up to %d bytes with io_uring", URING_BUFSIZE);
+    return;
+
+ fail:
+    uring_exit(&ring);
+    Free(ringbuf);
+    ringbuf = NULL;
+}
+
+/*
+ * send_file_uring - send a file of filesize bytes, which must fit in
+ *     the registered buffer, with a single io_uring_enter: an openat
+ *     into the file slot, a read into the buffer, a write of the
+ *     buffer to fd and a close of the slot, each linked to the one
+ *     before. Returns -1, having sent nothing, if the ring is not in
+ *     use or the file could not be read in full; the caller then
+ *     falls back to mmap and write. Returns -2 if writing to fd
+ *     failed, and 0 otherwise.
+ */
+int send_file_uring(int fd, char *filename, size_t filesize)
+{
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int i, res[4];
+
+    if (ring.fd < 0)
+	return -1;
+    sqe = uring_get_sqe(&ring);
+    uring_prep_openat(sqe, AT_FDCWD, filename, O_RDONLY, 0, 0);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = 0;
+    sqe = uring_get_sqe(&ring);
+    uring_prep_read_fixed(sqe, 0, ringbuf, filesize, 0, 0);
+    sqe->flags = IOSQE_IO_LINK | IOSQE_FIXED_FILE;
+    sqe->user_data = 1;
+    sqe = uring_get_sqe(&ring);
+    uring_prep_write_fixed(sqe, fd, ringbuf, filesize, 0, 0);
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = 2;
+    sqe = uring_get_sqe(&ring);
+    uring_prep_close(sqe, 0, 0);
+    sqe->user_data = 3;
+    if (uring_submit(&ring, 4) < 0)
+	unix_error("io_uring_enter error");
+
+    /* A failed or short step cancels the rest of the chain */
+    for (i = 0; i < 4; i++) {
+	if (uring_wait_cqe(&ring, &cqe) < 0)
+	    unix_error("io_uring_enter error");
+	res[cqe->user_data] = cqe->res;
+	uring_cqe_seen(&ring);
+    }
+    if (res[1] != filesize)
+	return -1;          /* Nothing written; the next openat reuses */
+    if (res[2] == -ECANCELED || res[2] == 0)
+	return -1;          /*   the slot, closing what it still holds */
+    if (res[2] < 0)
+	return -2;
+    if (res[2] < filesize &&              /* Short write */
+	rio_writen(fd, ringbuf + res[2], filesize - res[2]) < 0)
+	return -2;
+    return 0;
+}
+#endif
+
+/*
+ * make_etag - build a strong entity tag from the identity of a file
+ *     version; suffix tells apart encodings produced from one file
+ */
+void make_etag(struct stat *sbuf, char *suffix, char *etag)
+{
+    sprintf(etag, "\"%lx-%lx%09lx-%lx%s\"", (unsigned long)sbuf->st_ino,
+	    (unsigned long)sbuf->st_mtim.tv_sec, 
+	    (unsigned long)sbuf->st_mtim.tv_nsec,
+	    (unsigned long)sbuf->st_size, suffix);
+}
+
+/*
+ * not_modified - return 1 if the client's cached copy is current:
+ *     If-None-Match lists etag (or "*"), or, when there is no
+ *     If-None-Match, mtime is no later than If-Modified-Since
+ */
+int not_modified(reqhdrs_t *rq, char *etag, time_t mtime)
+{
+    char *p = rq->if_none_match;
+    size_t n, len = strlen(etag);
+
+    if (*p == '\0')
+	return rq->if_modified_since != -1 && mtime <= rq->if_modified_since;
+
+    while (*p) {
+	p += strspn(p, " \t,");
+	if (*p == '*')
+	    return 1;
+	if (!strncmp(p, "W/", 2))  /* GET compares tags weakly */
+	    p += 2;
+	n = strcspn(p, " \t,");
+	if (n == len && !strncmp(p, etag, len))
+	    return 1;
+	p += n;
+    }
+    return 0;
+}
+
+/*
+ * serve_not_modified - send a 304 carrying the validators but no body
+ */
+void serve_not_modified(int fd, char *etag, time_t mtime, int vary, 
+			reqhdrs_t *rq)
+{
+    char buf[MAXBUF], date[64];
+
+    format_httpdate(mtime, date);
+    sprintf(buf, "HTTP/1.%d 304 Not Modified\r\n"
+	    "Server: Tiny Web Server\r\n"
+	    "Connection: %s\r\n"
+	    "%s"
+	    "ETag: %s\r\n"
+	    "Last-Modified: %s\r\n\r\n",
+	    rq->http11, rq->keep_alive ? "keep-alive" : "close",
+	    vary ? "Vary: Accept-Encoding\r\n" : "", etag, date);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+	rq->keep_alive = 0;
+    rq->status = 304;
+    rq->bytes = 0;
+}
+
+/*
+ * format_httpdate - format t as an RFC 7231 IMF-fixdate
+ */
+void format_httpdate(time_t t, char *buf)
+{
+    static const char *days[] = 
+	{ "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+    static const char *months[] = { "Jan", "Feb", "Mar", "Apr", "May", 
+	"Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    struct tm tm;
+
+    gmtime_r(&t, &tm);
+    sprintf(buf, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday],
+	    tm.tm_mday, months[tm.tm_mon], tm.tm_year + 1900, 
+	    tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+/*
+ * parse_httpdate - parse an IMF-fixdate; returns -1 if s isn't one
+ */
+time_t parse_httpdate(char *s)
 {
-    if (strstr(filename, ".html"))
-	strcpy(filetype, "text/html");
-    else if (strstr(filename, ".gif"))
-	strcpy(filetype, "image/gif");
-    else if (strstr(filename, ".png"))
-	strcpy(filetype, "image/png");
-    else if (strstr(filename, ".jpg"))
-	strcpy(filetype, "image/jpeg");
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4], *p;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(s, " %*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, mon, 
+	       &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 ||
+	strlen(mon) != 3 || (p = strstr(months, mon)) == NULL)
+	return -1;
+    tm.tm_mon = (p - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * serve_dirlist - send the listing of directory dirname, requested
+ *     as uri
+ */
+void serve_dirlist(int fd, char *dirname, char *uri, struct stat *sbuf, 
+		   reqhdrs_t *rq)
+{
+    char etag[64], date[64];
+    dirlist_t *dl;
+    resp_t rb;
+
+    make_etag(sbuf, "-d", etag);
+    if (not_modified(rq, etag, sbuf->st_mtime)) {
+	serve_not_modified(fd, etag, sbuf->st_mtime, 0, rq);
+	return;
+    }
+    if ((dl = get_dirlist(dirname, uri, sbuf)) == NULL) {
+	clienterror(fd, dirname, "403", "Forbidden",
+		    "Tiny couldn't read the directory", rq);
+	return;
+    }
+
+    format_httpdate(sbuf->st_mtime, date);
+    resp_init(&rb);
+    resp_printf(&rb, "HTTP/1.%d 200 OK\r\n"
+		"Server: Tiny Web Server\r\n"
+		"Connection: %s\r\n"
+		"ETag: %s\r\n"
+		"Last-Modified: %s\r\n"
+		"Content-length: %zu\r\n"
+		"Content-type: text/html\r\n\r\n",
+		rq->http11, rq->keep_alive ? "keep-alive" : "close",
+		etag, date, dl->len);
+    resp_addb(&rb, dl->html, dl->len);
+    if (resp_flush(fd, &rb, 0) < 0)
+	rq->keep_alive = 0;
+    rq->status = 200;
+    rq->bytes = dl->len;
+}
+
+/*
+ * get_dirlist - return the cached listing of dirname, rendering it
+ *     if there is none or the directory changed since. The listing
+ *     shows names only, and a directory's mtime changes whenever an
+ *     entry is added, removed or renamed, so the mtime check is
+ *     exact. Returns NULL if the directory can't be read.
+ */
+dirlist_t *get_dirlist(char *dirname, char *uri, struct stat *sbuf)
+{
+    DIR *dirp;
+    struct dirent *dep;
+    struct stat ebuf;
+    dirlist_t *dl;
+    char **names = NULL, path[MAXLINE];
+    size_t n = 0, ncap = 0, i, len = 0, cap = 0;
+    char *html = NULL;
+
+    dl = hashtab_get(&dirtab, dirname, strlen(dirname));
+    if (dl != NULL && dl->dev == sbuf->st_dev && dl->ino == sbuf->st_ino &&
+	dl->mtime.tv_sec == sbuf->st_mtim.tv_sec &&
+	dl->mtime.tv_nsec == sbuf->st_mtim.tv_nsec)
+	return dl;
+
+    if ((dirp = opendir(dirname)) == NULL)
+	return NULL;
+    while ((dep = readdir(dirp)) != NULL) {
+	if (dep->d_name[0] == '.')  /* Hidden, ".", ".." */
+	    continue;
+	if (n == ncap) {
+	    ncap = ncap ? 2 * ncap : 32;
+	    names = Realloc(names, ncap * sizeof(char *));
+	}
+	names[n] = Malloc(strlen(dep->d_name) + 2);
+	strcpy(names[n], dep->d_name);
+	snprintf(path, MAXLINE, "%s%s", dirname, dep->d_name);
+	if (stat(path, &ebuf) == 0 && S_ISDIR(ebuf.st_mode))
+	    strcat(names[n], "/");
+	n++;
+    }
+    closedir(dirp);
+    qsort(names, n, sizeof(char *), cmpname);
+
+    append(&html, &len, &cap, "<html><title>Index of ");
+    append_html(&html, &len, &cap, uri);
+    append(&html, &len, &cap, "</title><body>\r\n<h1>Index of ");
+    append_html(&html, &len, &cap, uri);
+    append(&html, &len, &cap, "</h1>\r\n<ul>\r\n");
+    for (i = 0; i < n; i++) {
+	append(&html, &len, &cap, "<li><a href=\"");
+	append_url(&html, &len, &cap, names[i]);
+	append(&html, &len, &cap, "\">");
+	append_html(&html, &len, &cap, names[i]);
+	append(&html, &len, &cap, "</a>\r\n");
+	free(names[i]);
+    }
+    free(names);
+    append(&html, &len, &cap, "</ul>\r\n<hr><em>The Tiny Web server</em>\r\n");
+
+    if (dl == NULL) {
+	dl = Malloc(sizeof(dirlist_t));
+	hashtab_put(&dirtab, dirname, strlen(dirname), dl);
+    }
     else
-	strcpy(filetype, "text/plain");
+	free(dl->html);
+    dl->dev = sbuf->st_dev;
+    dl->ino = sbuf->st_ino;
+    dl->mtime = sbuf->st_mtim;
+    dl->html = html;
+    dl->len = len;
+    return dl;
+}
+
+int cmpname(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * append - append string s to the growable buffer *buf
+ */
+void append(char **buf, size_t *len, size_t *cap, char *s)
+{
+    size_t n = strlen(s);
+
+    if (*len + n > *cap) {
+	*cap = 2 * (*len + n);
+	*buf = Realloc(*buf, *cap);
+    }
+    memcpy(*buf + *len, s, n);
+    *len += n;
+}
+
+/*
+ * append_html - append s with HTML special characters escaped
+ */
+void append_html(char **buf, size_t *len, size_t *cap, char *s)
+{
+    char c[2] = { 0, 0 };
+
+    for (; *s; s++) {
+	if (*s == '<')
+	    append(buf, len, cap, "&lt;");
+	else if (*s == '>')
+	    append(buf, len, cap, "&gt;");
+	else if (*s == '&')
+	    append(buf, len, cap, "&amp;");
+	else if (*s == '"')
+	    append(buf, len, cap, "&quot;");
+	else {
+	    c[0] = *s;
+	    append(buf, len, cap, c);
+	}
+    }
+}
+
+/*
+ * append_url - append s percent-encoded for use as a URL path
+ */
+void append_url(char **buf, size_t *len, size_t *cap, char *s)
+{
+    char c[4];
+
+    for (; *s; s++) {
+	if (isalnum((unsigned char)*s) || strchr("-._~/", *s)) {
+	    c[0] = *s;
+	    c[1] = '\0';
+	}
+	else
+	    sprintf(c, "%%%02X", (unsigned char)*s);
+	append(buf, len, cap, c);
+    }
+}
+
+/*
+ * find_precompressed - look for filename+ext next to filename. The
+ *     sibling is used only if it is a readable regular file no older
+ *     than the original, so a stale one is never served.
+ */
+int find_precompressed(char *filename, char *ext, struct stat *sbuf,
+		       char *zfilename, struct stat *zsbuf)
+{
+    if (strlen(filename) + strlen(ext) >= MAXLINE)
+	return 0;
+    sprintf(zfilename, "%s%s", filename, ext);
+    if (stat(zfilename, zsbuf) < 0)
+	return 0;
+    return S_ISREG(zsbuf->st_mode) && (S_IRUSR & zsbuf->st_mode) &&
+	zsbuf->st_mtime >= sbuf->st_mtime;
+}
+
+/*
+ * get_filetype - derive file type from the extension of the last
+ *     component of the file name
+ */
+void get_filetype(char *filename, char *filetype) 
+{
+    char *base, *ext, *type = NULL;
+
+    base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
+    if ((ext = strrchr(base, '.')) != NULL)
+	type = hashtab_get(&mimetab, ext + 1, strlen(ext + 1));
+    strcpy(filetype, type ? type : DEFAULT_TYPE);
 }  
+
+/*
+ * is_compressible - return 1 for textual types that gzip well
+ */
+int is_compressible(char *filetype)
+{
+    return !strncmp(filetype, "text/", 5) ||
+	!strcmp(filetype, "application/javascript") ||
+	!strcmp(filetype, "application/json") ||
+	!strcmp(filetype, "image/svg+xml");
+}
 /* $end serve_static */
 
 /*
- * serve_dynamic - run a CGI program on behalf of the client
+ * serve_dynamic - run a CGI program on behalf of the client. The
+ *     program's output comes back through a pipe so that Tiny can
+ *     frame it: its own Content-length is kept if it sent one,
+ *     otherwise the body is chunked for HTTP/1.1 clients and the
+ *     connection is closed for HTTP/1.0 ones. Returns 1 if the
+ *     connection can carry another request.
  */
 /* $begin serve_dynamic */
-void serve_dynamic(int fd, char *filename, char *cgiargs) 
+int serve_dynamic(int fd, char *filename, char *cgiargs, reqhdrs_t *rq) 
 {
-    char buf[MAXLINE], *emptylist[] = { NULL };
+    char buf[MAXLINE], hdrs[MAXBUF], body[MAXBUF], *emptylist[] = { NULL };
+    int pipefd[2], has_length = 0, chunked;
+    size_t hdrlen;
+    ssize_t n;
+    rio_t cgi;
+    resp_t rb;
 
-    /* Return first part of HTTP response */
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); 
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-  
+    if (pipe(pipefd) < 0)
+	unix_error("Pipe error");
     if (Fork() == 0) { /* Child */ //line:netp:servedynamic:fork
 	/* Real server would set all CGI vars here */
+	Close(pipefd[0]);
 	setenv("QUERY_STRING", cgiargs, 1); //line:netp:servedynamic:setenv
-	Dup2(fd, STDOUT_FILENO);         /* Redirect stdout to client */ //line:netp:servedynamic:dup2
+	Dup2(pipefd[1], STDOUT_FILENO);  /* Redirect stdout to Tiny */ //line:netp:servedynamic:dup2
 	Execve(filename, emptylist, environ); /* Run CGI program */ //line:netp:servedynamic:execve
     }
+    Close(pipefd[1]);
+
+    /* Collect the headers the CGI program produced */
+    sprintf(hdrs, "HTTP/1.%d 200 OK\r\n", rq->http11);
+    strcat(hdrs, "Server: Tiny Web Server\r\n");
+    hdrlen = strlen(hdrs);
+    Rio_readinitb(&cgi, pipefd[0]);
+    while ((n = Rio_readlineb(&cgi, buf, MAXLINE)) > 0 && strcmp(buf, "\r\n")) {
+	if (!strncasecmp(buf, "Connection:", 11))
+	    continue;    /* Tiny decides about the connection */
+	if (hdrlen + n >= MAXBUF - 64)
+	    continue;    /* Leave room for the framing headers */
+	if (!strncasecmp(buf, "Content-length:", 15))
+	    has_length = 1;
+	strcpy(hdrs + hdrlen, buf);
+	hdrlen += n;
+    }
+    rq->keep_alive = rq->keep_alive && (has_length || rq->http11);
+    chunked = rq->keep_alive && !has_length;
+    sprintf(hdrs + hdrlen, "%sConnection: %s\r\n\r\n",
+	    chunked ? "Transfer-Encoding: chunked\r\n" : "",
+	    rq->keep_alive ? "keep-alive" : "close");
+
+    /* Relay the body; the headers go out with the first piece */
+    resp_init(&rb);
+    resp_addb(&rb, hdrs, strlen(hdrs));
+    rq->status = 200;
+    while ((n = Rio_readnb(&cgi, body, MAXBUF)) > 0) {
+	rq->bytes += n;
+	if (chunked)
+	    resp_printf(&rb, "%zx\r\n", n);
+	resp_addb(&rb, body, n);
+	if (chunked)
+	    resp_printf(&rb, "\r\n");
+	if (resp_flush(fd, &rb, 0) < 0) {
+	    rq->keep_alive = 0;
+	    break;
+	}
+    }
+    if (chunked)
+	resp_printf(&rb, "0\r\n\r\n");
+    if (n <= 0 && resp_flush(fd, &rb, 0) < 0)
+	rq->keep_alive = 0;
+    Close(pipefd[0]);
     Wait(NULL); /* Parent waits for and reaps child */ //line:netp:servedynamic:wait
+    return rq->keep_alive;
 }
 /* $end serve_dynamic */
 
@@ -220,26 +1087,29 @@ void serve_dynamic(int fd, char *filename, char *cgiargs)
  */
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum, 
-		 char *shortmsg, char *longmsg) 
-{
-    char buf[MAXLINE];
-
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<body bgcolor=""ffffff"">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+		 char *shortmsg, char *longmsg, reqhdrs_t *rq) 
+{
+    char body[MAXBUF];
+    resp_t rb;
+
+    /* Build the HTTP response body */
+    sprintf(body, "<html><title>Tiny Error</title>");
+    sprintf(body + strlen(body), "<body bgcolor=""ffffff"">\r\n");
+    sprintf(body + strlen(body), "%s: %s\r\n", errnum, shortmsg);
+    snprintf(body + strlen(body), MAXLINE, "<p>%s: %.*s\r\n",
+	     longmsg, MAXLINE / 2, cause);
+    sprintf(body + strlen(body), "<hr><em>The Tiny Web server</em>\r\n");
+
+    /* Send the HTTP response headers and body in one writev */
+    resp_init(&rb);
+    resp_printf(&rb, "HTTP/1.%d %s %s\r\n", rq->http11, errnum, shortmsg);
+    resp_printf(&rb, "Connection: %s\r\n", rq->keep_alive ? "keep-alive" : "close");
+    resp_printf(&rb, "Content-length: %d\r\n", (int)strlen(body));
+    resp_printf(&rb, "Content-type: text/html\r\n\r\n");
+    resp_addb(&rb, body, strlen(body));
+    if (resp_flush(fd, &rb, 0) < 0)
+	rq->keep_alive = 0;
+    rq->status = atoi(errnum);
+    rq->bytes = strlen(body);
 }
 /* $end clienterror */
@@ -0,0 +1,332 @@
+/*
+ * uring.c - minimal io_uring interface on raw system calls
+ *
+ * io_uring lets a process queue many I/O operations in a ring shared
+ * with the kernel and start all of them with one io_uring_enter call,
+ * instead of paying one system call per read, write or open. This file
+ * sets up the rings without liburing: io_uring_setup returns a
+ * descriptor, the submission and completion rings are mmapped from it,
+ * and the head/tail indices are read and written with acquire/release
+ * atomics as the kernel expects.
+ *
+ * Operations are queued by taking an SQE with uring_get_sqe and filling
+ * it with one of the uring_prep_* functions; uring_submit publishes the
+ * queued SQEs and optionally waits for completions. Registered buffers
+ * (read_fixed/write_fixed) save the kernel from pinning user pages on
+ * every call, and registered files let an openat place its result in a
+ * slot that later operations in the same batch refer to with
+ * IOSQE_FIXED_FILE.
+ *
+ * All functions return -1 with errno set on error. uring_init fails
+ * on kernels without io_uring, or where it is disabled, so callers can
+ * fall back to ordinary system calls.
+ */
+#include "uring.h"
+
+static int sys_setup(unsigned entries, struct io_uring_params *p);
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags);
+static int sys_register(int fd, unsigned opcode, const void *arg,
+                        unsigned nr_args);
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+                    const void *addr, unsigned len, __u64 off);
+
+/*
+ * uring_init - set up a ring with room for entries submissions. On
+ *     failure ur->fd is -1 and the ring must not be used.
+ */
+int uring_init(Uring *ur, unsigned entries)
+{
+    struct io_uring_params p;
+    char *sq, *cq;
+    int saved;
+
+    memset(ur, 0, sizeof(*ur));
+    memset(&p, 0, sizeof(p));
+    if ((ur->fd = sys_setup(entries, &p)) < 0) {
+        ur->fd = -1;
+        return -1;
+    }
+
+    ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ur->cq_ring_size = p.cq_off.cqes +
+        p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {  /* One mapping for both */
+        if (ur->cq_ring_size > ur->sq_ring_size)
+            ur->sq_ring_size = ur->cq_ring_size;
+        ur->cq_ring_size = ur->sq_ring_size;
+    }
+    ur->sq_ring = mmap(0, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+    if (ur->sq_ring == MAP_FAILED)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ur->cq_ring = ur->sq_ring;
+    else {
+        ur->cq_ring = mmap(0, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ur->fd,
+                           IORING_OFF_CQ_RING);
+        if (ur->cq_ring == MAP_FAILED) {
+            ur->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ur->sqes = mmap(0, ur->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+    if (ur->sqes == MAP_FAILED) {
+        ur->sqes = NULL;
+        goto fail;
+    }
+
+    sq = ur->sq_ring;
+    ur->sq_head = (unsigned *)(sq + p.sq_off.head);
+    ur->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ur->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ur->sq_array = (unsigned *)(sq + p.sq_off.array);
+    cq = ur->cq_ring;
+    ur->cq_head = (unsigned *)(cq + p.cq_off.head);
+    ur->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ur->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ur->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ur->sq_local = *ur->sq_tail;
+    return 0;
+
+ fail:
+    if (ur->sq_ring == MAP_FAILED)
+        ur->sq_ring = NULL;
+    saved = errno;
+    uring_exit(ur);
+    errno = saved;
+    return -1;
+}
+
+/*
+ * uring_exit - tear down the ring; registered buffers and files are
+ *     released with it
+ */
+void uring_exit(Uring *ur)
+{
+    if (ur->sqes != NULL)
+        munmap(ur->sqes, ur->sqes_size);
+    if (ur->cq_ring != NULL && ur->cq_ring != ur->sq_ring)
+        munmap(ur->cq_ring, ur->cq_ring_size);
+    if (ur->sq_ring != NULL)
+        munmap(ur->sq_ring, ur->sq_ring_size);
+    if (ur->fd >= 0)
+        close(ur->fd);
+    memset(ur, 0, sizeof(*ur));
+    ur->fd = -1;
+}
+
+/*
+ * uring_probe - return 1 if the kernel supports all n opcodes in ops,
+ *     0 if it lacks one of them
+ */
+int uring_probe(Uring *ur, const int *ops, int n)
+{
+    struct io_uring_probe *probe;
+    size_t size;
+    int i, ok = 1;
+
+    size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    probe = Calloc(1, size);
+    if (sys_register(ur->fd, IORING_REGISTER_PROBE, probe, 256) < 0)
+        ok = 0;
+    for (i = 0; ok && i < n; i++)
+        if (ops[i] > probe->last_op ||
+            !(probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED))
+            ok = 0;
+    Free(probe);
+    return ok;
+}
+
+/*
+ * uring_register_buffers - pin n buffers for read_fixed/write_fixed;
+ *     an SQE names one by its index in iov
+ */
+int uring_register_buffers(Uring *ur, const struct iovec *iov, unsigned n)
+{
+    return sys_register(ur->fd, IORING_REGISTER_BUFFERS, iov, n);
+}
+
+/*
+ * uring_register_files - install a table of n files; an entry of -1
+ *     leaves the slot empty for an openat to fill
+ */
+int uring_register_files(Uring *ur, const int *fds, unsigned n)
+{
+    return sys_register(ur->fd, IORING_REGISTER_FILES, fds, n);
+}
+
+/*
+ * uring_get_sqe - take the next free submission entry, cleared, or
+ *     NULL if the submission queue is full
+ */
+struct io_uring_sqe *uring_get_sqe(Uring *ur)
+{
+    struct io_uring_sqe *sqe;
+    unsigned head = __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE);
+
+    if (ur->sq_local - head > *ur->sq_mask)
+        return NULL;
+    sqe = &ur->sqes[ur->sq_local & *ur->sq_mask];
+    ur->sq_array[ur->sq_local & *ur->sq_mask] = ur->sq_local & *ur->sq_mask;
+    ur->sq_local++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*
+ * uring_submit - hand the queued SQEs to the kernel and wait until at
+ *     least wait_nr completions are ready. Returns the number of SQEs
+ *     consumed.
+ */
+int uring_submit(Uring *ur, unsigned wait_nr)
+{
+    unsigned n = ur->sq_local - *ur->sq_tail;
+    int rc;
+
+    __atomic_store_n(ur->sq_tail, ur->sq_local, __ATOMIC_RELEASE);
+    if (n == 0 && wait_nr == 0)
+        return 0;
+    while ((rc = sys_enter(ur->fd, n, wait_nr,
+                           wait_nr ? IORING_ENTER_GETEVENTS : 0)) < 0)
+        if (errno != EINTR)
+            return -1;
+    return rc;
+}
+
+/*
+ * uring_peek_cqe - point *cqep at the oldest completion without
+ *     waiting. Returns -1 with errno EAGAIN if there is none.
+ */
+int uring_peek_cqe(Uring *ur, struct io_uring_cqe **cqep)
+{
+    unsigned head = *ur->cq_head;
+
+    if (head == __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    *cqep = &ur->cqes[head & *ur->cq_mask];
+    return 0;
+}
+
+/*
+ * uring_wait_cqe - like uring_peek_cqe, but block for a completion
+ */
+int uring_wait_cqe(Uring *ur, struct io_uring_cqe **cqep)
+{
+    while (uring_peek_cqe(ur, cqep) < 0)
+        if (uring_submit(ur, 1) < 0)
+            return -1;
+    return 0;
+}
+
+/*
+ * uring_cqe_seen - release the completion returned by peek/wait
+ */
+void uring_cqe_seen(Uring *ur)
+{
+    __atomic_store_n(ur->cq_head, *ur->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd,
+                       struct sockaddr *addr, socklen_t *addrlen)
+{
+    prep_rw(sqe, IORING_OP_ACCEPT, fd, addr, 0, (__u64)(uintptr_t)addrlen);
+}
+
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned n, off_t off)
+{
+    prep_rw(sqe, IORING_OP_READ, fd, buf, n, off);
+}
+
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, void *buf,
+                      unsigned n, off_t off)
+{
+    prep_rw(sqe, IORING_OP_WRITE, fd, buf, n, off);
+}
+
+/*
+ * uring_prep_read_fixed, uring_prep_write_fixed - buf must lie inside
+ *     registered buffer buf_index
+ */
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                           unsigned n, off_t off, int buf_index)
+{
+    prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, n, off);
+    sqe->buf_index = buf_index;
+}
+
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                            unsigned n, off_t off, int buf_index)
+{
+    prep_rw(sqe, IORING_OP_WRITE_FIXED, fd, buf, n, off);
+    sqe->buf_index = buf_index;
+}
+
+/*
+ * uring_prep_openat - open path relative to dfd. With file_index >= 0
+ *     the file goes into that registered slot instead of getting a
+ *     descriptor, and the completion result is 0.
+ */
+void uring_prep_openat(struct io_uring_sqe *sqe, int dfd, char *path,
+                       int flags, mode_t mode, int file_index)
+{
+    prep_rw(sqe, IORING_OP_OPENAT, dfd, path, mode, 0);
+    sqe->open_flags = flags;
+    if (file_index >= 0)
+        sqe->file_index = file_index + 1;
+}
+
+void uring_prep_statx(struct io_uring_sqe *sqe, int dfd, char *path,
+                      int flags, unsigned mask, struct statx *stxbuf)
+{
+    prep_rw(sqe, IORING_OP_STATX, dfd, path, mask,
+            (__u64)(uintptr_t)stxbuf);
+    sqe->statx_flags = flags;
+}
+
+/*
+ * uring_prep_close - close fd, or registered slot file_index if it
+ *     is >= 0
+ */
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, int file_index)
+{
+    prep_rw(sqe, IORING_OP_CLOSE, file_index >= 0 ? 0 : fd, NULL, 0, 0);
+    if (file_index >= 0)
+        sqe->file_index = file_index + 1;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+                    const void *addr, unsigned len, __u64 off)
+{
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (__u64)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+/* glibc has no wrappers for the io_uring system calls */
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned to_submit, unsigned min_complete,
+                     unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned opcode, const void *arg,
+                        unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
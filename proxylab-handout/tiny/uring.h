@@ -0,0 +1,62 @@
+/*
+ * uring.h - minimal io_uring interface on raw system calls
+ */
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/syscall.h>
+#include "csapp.h"
+
+/* A submission/completion ring pair shared with the kernel */
+typedef struct {
+    int fd;                   /* -1 when io_uring is unavailable */
+    unsigned *sq_head;        /* Submission queue, in the shared ring */
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;        /* SQEs handed out but not yet published */
+    unsigned *cq_head;        /* Completion queue, in the shared ring */
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;            /* Mappings, for uring_exit */
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} Uring;
+
+int uring_init(Uring *ur, unsigned entries);
+void uring_exit(Uring *ur);
+int uring_probe(Uring *ur, const int *ops, int n);
+
+int uring_register_buffers(Uring *ur, const struct iovec *iov, unsigned n);
+int uring_register_files(Uring *ur, const int *fds, unsigned n);
+
+struct io_uring_sqe *uring_get_sqe(Uring *ur);
+int uring_submit(Uring *ur, unsigned wait_nr);
+int uring_wait_cqe(Uring *ur, struct io_uring_cqe **cqep);
+int uring_peek_cqe(Uring *ur, struct io_uring_cqe **cqep);
+void uring_cqe_seen(Uring *ur);
+
+void uring_prep_accept(struct io_uring_sqe *sqe, int fd,
+                       struct sockaddr *addr, socklen_t *addrlen);
+void uring_prep_read(struct io_uring_sqe *sqe, int fd, void *buf,
+                     unsigned n, off_t off);
+void uring_prep_write(struct io_uring_sqe *sqe, int fd, void *buf,
+                      unsigned n, off_t off);
+void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                           unsigned n, off_t off, int buf_index);
+void uring_prep_write_fixed(struct io_uring_sqe *sqe, int fd, void *buf,
+                            unsigned n, off_t off, int buf_index);
+void uring_prep_openat(struct io_uring_sqe *sqe, int dfd, char *path,
+                       int flags, mode_t mode, int file_index);
+void uring_prep_statx(struct io_uring_sqe *sqe, int dfd, char *path,
+                      int flags, unsigned mask, struct statx *stxbuf);
+void uring_prep_close(struct io_uring_sqe *sqe, int fd, int file_index);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * tunnel.c - zero-copy byte relay for CONNECT tunnels
+ *
+ * Once a tunnel is set up the proxy only shovels bytes. Each direction
+ * moves them with splice() from the source socket into a pipe and from
+ * the pipe into the other socket, so the payload is never copied into
+ * user space. Both sockets are nonblocking and one poll() loop drives
+ * both directions; a direction stops reading while its pipe is full
+ * and resumes when the destination drains it.
+ *
+ * Half-closes are passed through: when one side shuts down its write
+ * side and its pipe is empty, the other side's write side is shut down
+ * too. The relay ends when both directions are done, on an error, or
+ * when neither side sends anything for the idle timeout. A side that
+ * reports an error or hangs up while it still has bytes to take ends
+ * the relay, as a reset.
+ *
+ * This file is built with _GNU_SOURCE for splice() and F_SETPIPE_SZ and
+ * so does not include csapp.h, whose gai_error clashes with glibc's.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+/* One direction of a tunnel: bytes move from -> pipe -> to */
+typedef struct {
+    int from, to;
+    int pipe[2];
+    size_t pipesize;          /* What the pipe holds */
+    size_t inpipe;            /* Spliced in, not yet spliced out */
+    int eof;                  /* 1: from hit EOF, 2: and to was shut down */
+    long bytes;               /* Total relayed */
+} tunnel_dir_t;
+
+/*
+ * relay - move what one direction can move without blocking: splice
+ *     bytes into its pipe if the source polled readable, then as much
+ *     of the pipe as the destination takes. Returns -1 on error.
+ */
+static int relay(tunnel_dir_t *dir, short revents)
+{
+    ssize_t n;
+
+    if (!dir->eof && (revents & (POLLIN | POLLHUP | POLLERR))) {
+        n = splice(dir->from, NULL, dir->pipe[1], NULL, dir->pipesize - dir->inpipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0)
+            dir->inpipe += n;
+        else if (n == 0)
+            dir->eof = 1;
+        else if (errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (dir->inpipe > 0) {
+        n = splice(dir->pipe[0], NULL, dir->to, NULL, dir->inpipe,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            dir->inpipe -= n;
+            dir->bytes += n;
+        }
+        else if (n < 0 && errno != EAGAIN && errno != EINTR)
+            return -1;
+    }
+    if (dir->eof == 1 && dir->inpipe == 0) {
+        shutdown(dir->to, SHUT_WR);
+        dir->eof = 2;
+    }
+    return 0;
+}
+
+/*
+ * tunnel_relay - relay bytes between clientfd and serverfd until both
+ *     have closed. *up and *down count the bytes sent to the server and
+ *     to the client. Returns 0, or -1 with errno set on an error or
+ *     (ETIMEDOUT) after idle_ms without traffic. Leaves both sockets
+ *     nonblocking; the caller closes them.
+ */
+int tunnel_relay(int clientfd, int serverfd, int idle_ms, long *up, long *down)
+{
+    tunnel_dir_t dir[2];      /* [0]: client to server, [1]: back */
+    struct pollfd pfd[2];
+    int i, n, size, rc = 0;
+
+    memset(dir, 0, sizeof(dir));
+    dir[0].from = dir[1].to = clientfd;
+    dir[0].to = dir[1].from = serverfd;
+    for (i = 0; i < 2; i++) {
+        if (pipe(dir[i].pipe) < 0) {
+            if (i == 1) {
+                close(dir[0].pipe[0]);
+                close(dir[0].pipe[1]);
+            }
+            return -1;
+        }
+        /* Best effort: past its pipe page quota a user gets smaller pipes */
+        fcntl(dir[i].pipe[0], F_SETPIPE_SZ, TUNNEL_PIPESIZE);
+        size = fcntl(dir[i].pipe[0], F_GETPIPE_SZ);
+        dir[i].pipesize = (size > 0) ? size : getpagesize(); /* The least a pipe holds */
+        fcntl(dir[i].from, F_SETFL, fcntl(dir[i].from, F_GETFL, 0) | O_NONBLOCK);
+    }
+
+    while (dir[0].eof < 2 || dir[1].eof < 2) {
+        /* pfd[i] is the source of dir[i] and the destination of dir[1-i] */
+        for (i = 0; i < 2; i++) {
+            pfd[i].fd = dir[i].from;
+            pfd[i].events = 0;
+        }
+        for (i = 0; i < 2; i++) {
+            if (!dir[i].eof && dir[i].inpipe < dir[i].pipesize)
+                pfd[i].events |= POLLIN;
+            if (dir[i].inpipe > 0)
+                pfd[1 - i].events |= POLLOUT;
+        }
+        /* Leave out a side with nothing to wait for, or its POLLHUP spins */
+        for (i = 0; i < 2; i++)
+            if (pfd[i].events == 0)
+                pfd[i].fd = -1;
+        if ((n = poll(pfd, 2, idle_ms)) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -1;
+            break;
+        }
+        if (n == 0) {
+            errno = ETIMEDOUT;
+            rc = -1;
+            break;
+        }
+        for (i = 0; i < 2; i++)
+            if ((pfd[i].revents & (POLLERR | POLLHUP)) && !(pfd[i].events & POLLIN))
+                break;
+        if (i < 2) {
+            errno = ECONNRESET;
+            rc = -1;
+            break;
+        }
+        if (relay(&dir[0], pfd[0].revents) < 0 || relay(&dir[1], pfd[1].revents) < 0) {
+            rc = -1;
+            break;
+        }
+    }
+
+    *up = dir[0].bytes;
+    *down = dir[1].bytes;
+    for (i = 0; i < 2; i++) {
+        close(dir[i].pipe[0]);
+        close(dir[i].pipe[1]);
+    }
+    return rc;
+}
@@ -0,0 +1,11 @@
+/*
+ * tunnel.h - zero-copy byte relay for CONNECT tunnels
+ */
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+#define TUNNEL_PIPESIZE (256 * 1024) /* Bytes in flight per direction */
+
+int tunnel_relay(int clientfd, int serverfd, int idle_ms, long *up, long *down);
+
+#endif